@@ -0,0 +1,254 @@
+//============================================================================
+// Name        : benchmark.cpp
+// Description : rays per second of the single intersection and shading kernels,
+//               single threaded on fixed ray sets derived from the scene cameras.
+//
+// usage: benchmark [--rays N] [--repeat N] [--format json|csv] [scene.test ...]
+// Every measurement is printed as one line, json objects by default. For the single primitive
+// kernels (Triangle, Sphere) every ray-primitive test counts as a ray.
+//============================================================================
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "readScene.h"
+#include "lighting.h"
+
+struct Ray {
+	glm::vec3 origin;
+	glm::vec3 direction;
+	float t_max;
+};
+
+// a hit of a primary ray, input for the shading kernel
+struct ShadingSample {
+	glm::vec3 rayDir;
+	glm::vec3 normal;
+	glm::vec3 lightDir;
+	glm::vec3 lightColor;
+	int materialIndex;
+};
+
+struct BenchmarkOptions {
+	int rays = 1 << 16;
+	int repeat = 5;
+	bool csv = false;
+	std::vector<std::string> scenes;
+};
+
+// keeps the compiler from dropping the measured work
+static volatile float benchmarkSink;
+
+// best of repeat runs of kernel(), which has to do `work` ray queries
+template<typename Kernel>
+void measure(const BenchmarkOptions &options, const std::string &scene, const std::string &kernelName, size_t work, Kernel kernel) {
+	if(work == 0) {
+		return;
+	}
+	double best = 1e30;
+	float checksum = 0;
+	for(int run = 0; run < options.repeat; run++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		checksum = kernel();
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		best = std::min(best, elapsed.count());
+	}
+	benchmarkSink = checksum;
+
+	const double raysPerSecond = best > 0 ? double(work) / best : 0;
+	if(options.csv) {
+		std::cout << scene << "," << kernelName << "," << work << "," << best << "," << raysPerSecond << "," << checksum << std::endl;
+	}
+	else {
+		std::cout << "{\"scene\": \"" << scene << "\", \"kernel\": \"" << kernelName << "\", \"rays\": " << work
+				<< ", \"seconds\": " << best << ", \"rays_per_second\": " << raysPerSecond
+				<< ", \"checksum\": " << checksum << "}" << std::endl;
+	}
+}
+
+// primary rays through a regular grid of pixels covering the whole image
+std::vector<Ray> primaryRays(Camera &camera, int count) {
+	const int columns = std::max(1, int(glm::sqrt(float(count) * camera.width / camera.height)));
+	const int rows = std::max(1, count / columns);
+	std::vector<Ray> rays;
+	for(int row = 0; row < rows; row++) {
+		for(int column = 0; column < columns; column++) {
+			int x = column * camera.width / columns;
+			int y = row * camera.height / rows;
+			rays.push_back({camera.eye, camera.getRayAt(x, y), FLT_MAX});
+		}
+	}
+	return rays;
+}
+
+void benchmarkScene(const BenchmarkOptions &options, const std::string &filename) {
+	// scene reading and building report progress on stdout, keep that out of the results
+	std::streambuf *out = std::cout.rdbuf(std::cerr.rdbuf());
+
+	SceneReader sr;
+	sr.readScene(filename, AccelerationType::CONTAINER);
+	sr.camera.updateAxes();
+
+	const std::string scene = filename.substr(filename.find_last_of("/\\") + 1);
+	const std::vector<Ray> rays = primaryRays(sr.camera, options.rays);
+	const std::vector<PrimitiveRef> primitives = collectPrimitives(&sr.geometries);
+
+	Container container(&sr.geometries);
+	Grid grid(&sr.geometries);
+	BVH bvh(&sr.geometries);
+
+	// shadow rays from the primary hits towards every light, and the matching shading inputs
+	std::vector<Ray> shadowRays;
+	std::vector<ShadingSample> shadingSamples;
+	for(auto const& ray : rays) {
+		FragmentInfo fragmentInfo = bvh.intersect(ray.origin, ray.direction);
+		if(!fragmentInfo.validHit) {
+			continue;
+		}
+		for(auto const& light : sr.lights) {
+			Ray shadowRay;
+			if(light.type == LightType::POINT) {
+				shadowRay.direction = glm::normalize(light.position - fragmentInfo.position);
+				shadowRay.t_max = glm::dot(light.position - fragmentInfo.position, shadowRay.direction);
+			}
+			else {
+				shadowRay.direction = glm::normalize(light.position);
+				shadowRay.t_max = FLT_MAX;
+			}
+			shadowRay.origin = fragmentInfo.position + sr.epsilonBias * shadowRay.direction;
+			shadowRays.push_back(shadowRay);
+			shadingSamples.push_back({ray.direction, fragmentInfo.normal, shadowRay.direction, light.color, fragmentInfo.materialIndex});
+		}
+	}
+
+	// single primitive kernels, every ray against the first primitives of their kind
+	const size_t kernelPrimitives = 64;
+	std::vector<std::unique_ptr<Triangle>> triangles;
+	std::vector<Sphere*> spheres;
+	for(auto const& primitive : primitives) {
+		glm::vec3 A, B, C;
+		if(triangles.size() < kernelPrimitives && primitive.geometry_ptr->getWorldTriangle(primitive.primID, A, B, C)) {
+			triangles.push_back(std::make_unique<Triangle>(A, B, C, primitive.geometry_ptr->materialIndex, glm::mat4(1.f)));
+		}
+		if(spheres.size() < kernelPrimitives && dynamic_cast<Sphere*>(primitive.geometry_ptr)) {
+			spheres.push_back(static_cast<Sphere*>(primitive.geometry_ptr));
+		}
+	}
+
+	std::cout.rdbuf(out);
+
+	measure(options, scene, "Triangle::intersect", rays.size() * triangles.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : rays) {
+			for(auto const& triangle : triangles) {
+				HitInfo hitInfo = triangle->intersect(ray.origin, ray.direction, 0);
+				sum += hitInfo.validHit ? hitInfo.t : 0;
+			}
+		}
+		return sum;
+	});
+
+	measure(options, scene, "Sphere::intersect", rays.size() * spheres.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : rays) {
+			for(auto const& sphere : spheres) {
+				HitInfo hitInfo = sphere->intersect(ray.origin, ray.direction, 0);
+				sum += hitInfo.validHit ? hitInfo.t : 0;
+			}
+		}
+		return sum;
+	});
+
+	// brute force gets expensive on big scenes, only every containerStride-th ray is used there
+	const size_t containerStride = std::max<size_t>(1, rays.size() * primitives.size() >> 24);
+	measure(options, scene, "Container::intersect", (rays.size() + containerStride - 1) / containerStride, [&]() {
+		float sum = 0;
+		for(size_t i = 0; i < rays.size(); i += containerStride) {
+			FragmentInfo fragmentInfo = container.intersect(rays[i].origin, rays[i].direction);
+			sum += fragmentInfo.validHit ? fragmentInfo.t : 0;
+		}
+		return sum;
+	});
+
+	measure(options, scene, "Grid::intersect", rays.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : rays) {
+			FragmentInfo fragmentInfo = grid.intersect(ray.origin, ray.direction);
+			sum += fragmentInfo.validHit ? fragmentInfo.t : 0;
+		}
+		return sum;
+	});
+
+	measure(options, scene, "Grid::occluded", shadowRays.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : shadowRays) {
+			sum += grid.occluded(ray.origin, ray.direction, ray.t_max);
+		}
+		return sum;
+	});
+
+	measure(options, scene, "BVH::intersect", rays.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : rays) {
+			FragmentInfo fragmentInfo = bvh.intersect(ray.origin, ray.direction);
+			sum += fragmentInfo.validHit ? fragmentInfo.t : 0;
+		}
+		return sum;
+	});
+
+	measure(options, scene, "BVH::occluded", shadowRays.size(), [&]() {
+		float sum = 0;
+		for(auto const& ray : shadowRays) {
+			sum += bvh.occluded(ray.origin, ray.direction, ray.t_max);
+		}
+		return sum;
+	});
+
+	measure(options, scene, "calc_lighting", shadingSamples.size(), [&]() {
+		float sum = 0;
+		for(auto const& sample : shadingSamples) {
+			glm::vec3 color = calc_lighting(sample.rayDir, sample.lightDir, sample.normal, &sr.materials[sample.materialIndex], sample.lightColor);
+			sum += color[0] + color[1] + color[2];
+		}
+		return sum;
+	});
+}
+
+int main(int argc, char **argv) {
+	BenchmarkOptions options;
+	std::string format = "json";
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if(arg == "--rays" && i + 1 < argc) {
+			options.rays = std::max(1, std::atoi(argv[++i]));
+		}
+		else if(arg == "--repeat" && i + 1 < argc) {
+			options.repeat = std::max(1, std::atoi(argv[++i]));
+		}
+		else if(arg == "--format" && i + 1 < argc) {
+			format = argv[++i];
+		}
+		else {
+			options.scenes.push_back(arg);
+		}
+	}
+	options.csv = format == "csv";
+	if(options.scenes.empty()) {
+		options.scenes = { "res/scene5.test", "res/scene6.test", "res/scene7.test" };
+	}
+
+	if(options.csv) {
+		std::cout << "scene,kernel,rays,seconds,rays_per_second,checksum" << std::endl;
+	}
+	for(auto const& scene : options.scenes) {
+		benchmarkScene(options, scene);
+	}
+
+	return 0;
+}
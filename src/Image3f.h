@@ -1,6 +1,7 @@
 #ifndef IMAGE3F_H
 #define IMAGE3F_H
 
+#include <fstream>
 #include <iostream>
 
 #include <glm/glm.hpp>
@@ -8,9 +9,16 @@
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#ifndef RAYTRACER_NO_GUI
 #include <opencv2/highgui.hpp>
+#endif
 
+#include <algorithm>
+#include <cassert>
 #include <memory>
+#include <new>
+#include <vector>
 
 inline float clamp(float val, float min = 0.0f, float max = 1.0f) {
 	return glm::max(glm::min(val, max), min);
@@ -20,62 +28,162 @@ inline glm::vec3 clampRGB(glm::vec3 color) {
 	return glm::vec3(clamp(color[0]), clamp(color[1]), clamp(color[2]));
 }
 
+// how the color channels of an image are stored, both in BGR order like opencv expects them
+enum class PixelLayout {
+	INTERLEAVED,	// BGRBGR..., wraps into a CV_32FC3 cv::Mat without copying
+	PLANAR,			// one plane per channel, each plane wraps into a CV_32FC1 cv::Mat without copying
+};
+
 class Image3f {
-	const std::string ppmHeader = "P6";
+	static const size_t alignment = 64;
+
+	struct AlignedDelete {
+		void operator()(float *pixels) const {
+			::operator delete[](pixels, std::align_val_t(alignment));
+		}
+	};
+
+	std::unique_ptr<float[], AlignedDelete> pixels;	// one allocation for the whole frame, cache line aligned
+	size_t planeSize;	// floats per plane, a multiple of the alignment so every plane starts aligned
+	std::vector<unsigned char> bytes;	// 8 bit frame of the last save, reused by the next one
+
+	inline size_t offset(int x, int y, int channel) const {
+		size_t pixel = size_t(y - originY) * width + (x - originX);
+		return layout == PixelLayout::INTERLEAVED ? pixel * 3 + channel : channel * planeSize + pixel;
+	}
+
 public:
 
 	int width;
 	int height;
+	PixelLayout layout;
 
-	glm::vec3 **data;
+	// frame coordinates of the top left pixel. Tile buffers of a bigger frame are addressed in frame coordinates
+	int originX = 0;
+	int originY = 0;
 
-	Image3f(int width, int height) {
+	Image3f(int width, int height, PixelLayout layout = PixelLayout::INTERLEAVED) {
 		this->width = width;
 		this->height = height;
+		this->layout = layout;
 
-		// initialize 2D Array
-		data = new glm::vec3*[height];
-		for (int y = 0; y < height; y++) {
-			data[y] = new glm::vec3[width];
-		}
-	}
-
-	~Image3f() {
-		// free mem
-		for (int y = 0; y < height; y++) {
-			delete[] data[y];
-		}
-		delete[] data;
+		const size_t floatsPerLine = alignment / sizeof(float);
+		this->planeSize = (size_t(width) * height + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+		const size_t floatCount = layout == PixelLayout::INTERLEAVED ? size_t(width) * height * 3 : planeSize * 3;
+		pixels.reset(new (std::align_val_t(alignment)) float[std::max<size_t>(floatCount, 1)]());
 	}
 
 	// write pixel to image
 	void setAt(int x, int y, glm::vec3 color) {
-		data[y][x] = color;
+		float *pixels = this->pixels.get();
+		pixels[offset(x, y, 0)] = color[2];
+		pixels[offset(x, y, 1)] = color[1];
+		pixels[offset(x, y, 2)] = color[0];
 	}
 
 	// read pixel from image
 	glm::vec3 getAt(int x, int y) {
-		return data[y][x];
+		const float *pixels = this->pixels.get();
+		return glm::vec3(pixels[offset(x, y, 2)], pixels[offset(x, y, 1)], pixels[offset(x, y, 0)]);
+	}
+
+	void setOrigin(int x, int y) {
+		originX = x;
+		originY = y;
+	}
+
+	float* data() {
+		return pixels.get();
+	}
+
+	// the interleaved frame as CV_32FC3, sharing the pixels of this image
+	cv::Mat mat() {
+		assert(layout == PixelLayout::INTERLEAVED);
+		return cv::Mat(height, width, CV_32FC3, pixels.get());
+	}
+
+	// one channel (0 blue, 1 green, 2 red) of a planar frame as CV_32FC1, sharing the pixels of this image
+	cv::Mat plane(int channel) {
+		assert(layout == PixelLayout::PLANAR);
+		return cv::Mat(height, width, CV_32FC1, pixels.get() + channel * planeSize);
+	}
+
+	// clamps and converts the frame to 8 bit in parallel, row by row with vectorized inner loops.
+	// Channel order is BGR like the frame, or RGB for ppm
+	void convertTo8Bit(unsigned char *out, bool rgbOrder = false) const {
+		const float *pixels = this->pixels.get();
+		const int width = this->width;
+		const bool planar = layout == PixelLayout::PLANAR;
+		const size_t planeSize = this->planeSize;
+
+		#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; y++) {
+			const size_t row = size_t(y) * width;
+			unsigned char *line = out + row * 3;
+			if (!planar && !rgbOrder) {
+				const float *in = pixels + row * 3;
+				#pragma omp simd
+				for (int i = 0; i < width * 3; i++) {
+					line[i] = (unsigned char) (clamp(in[i]) * 255);
+				}
+			}
+			else {
+				for (int channel = 0; channel < 3; channel++) {
+					const int target = rgbOrder ? 2 - channel : channel;
+					const float *in = planar ? pixels + channel * planeSize + row : pixels + row * 3 + channel;
+					const size_t stride = planar ? 1 : 3;
+					#pragma omp simd
+					for (int x = 0; x < width; x++) {
+						line[x * 3 + target] = (unsigned char) (clamp(in[x * stride]) * 255);
+					}
+				}
+			}
+		}
+	}
+
+	// binary ppm, 8 bit RGB rows from top to bottom
+	static void writePpmHeader(std::ostream &out, int width, int height) {
+		out << "P6" << std::endl << width << ' ' << height << std::endl << "255" << std::endl;
+	}
+
+	// pfm, 32 bit little endian float RGB rows from bottom to top
+	static void writePfmHeader(std::ostream &out, int width, int height) {
+		out << "PF" << std::endl << width << ' ' << height << std::endl << "-1.0" << std::endl;
 	}
 
+	// RGB floats of the pixels [x0, x1) in row y, unclamped
+	void rowTo3f(int y, int x0, int x1, float *out) {
+		for (int x = x0; x < x1; x++) {
+			glm::vec3 color = getAt(x, y);
+			out[(x - x0) * 3] = color[0];
+			out[(x - x0) * 3 + 1] = color[1];
+			out[(x - x0) * 3 + 2] = color[2];
+		}
+	}
 
 	// write ppm from vec3
 	void write3fPpm(std::string filename) {
 		using namespace std;
+		bytes.resize(size_t(width) * height * 3);
+		convertTo8Bit(bytes.data(), true);
+
 		ofstream ofs(filename, ios_base::out | ios_base::binary);
-		ofs << ppmHeader << endl << width << ' ' << height << endl << "255"
-				<< endl;
+		writePpmHeader(ofs, width, height);
+		ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		ofs.close();
+	}
 
-		for (int y = 0; y < height; y++) {
-			for (int x = 0; x < width; x++) {
-				glm::vec3 color = getAt(x, y);
-				unsigned char r = (unsigned char) (clamp(color[0]) * 255);
-				unsigned char g = (unsigned char) (clamp(color[1]) * 255);
-				unsigned char b = (unsigned char) (clamp(color[2]) * 255);
-				ofs << r << g << b;
-			}
-		}
+	// write pfm, keeps the unclamped colors
+	void write3fPfm(std::string filename) {
+		using namespace std;
+		std::vector<float> row(size_t(width) * 3);
 
+		ofstream ofs(filename, ios_base::out | ios_base::binary);
+		writePfmHeader(ofs, width, height);
+		for (int y = height - 1; y >= 0; y--) {
+			rowTo3f(originY + y, originX, originX + width, row.data());
+			ofs.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+		}
 		ofs.close();
 	}
 
@@ -118,55 +226,46 @@ public:
 		}
 	}
 
+	// shows the image in a window for ms milliseconds (0 waits for a key), returns the pressed key.
+	// Builds without gui (RAYTRACER_NO_GUI) don't show anything and return -1
 	int display(int ms) {
-		auto buffer = get_3f_bgr_buffer();
-		cv::Mat flt_img(height, width, CV_32FC3, buffer.get()); /* Red Green Blue Alpha (RGBA) channels from the sdl surface */
-		cv::imshow("Display ", flt_img);
+#ifdef RAYTRACER_NO_GUI
+		return -1;
+#else
+		if (layout == PixelLayout::INTERLEAVED) {
+			cv::imshow("Display ", mat());
+		}
+		else {
+			cv::Mat merged;
+			cv::merge(std::vector<cv::Mat>{ plane(0), plane(1), plane(2) }, merged);
+			cv::imshow("Display ", merged);
+		}
 		return cv::waitKey(ms);
+#endif
 	}
 
-	void save(std::string filename) {
-		auto buffer = get_3b_bgr_buffer();
-		cv::Mat flt_img(height, width, CV_8UC3, buffer.get()); /* Red Green Blue Alpha (RGBA) channels from the sdl surface */
-		cv::imwrite(filename, flt_img);
-		std::cout << "Written to: " << filename << std::endl;
+	static bool hasExtension(const std::string &filename, const std::string &extension) {
+		return filename.size() >= extension.size()
+				&& filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
 	}
 
-private:
-	std::unique_ptr<float[]> get_3f_bgr_buffer() {
-		auto buffer_ptr = std::make_unique<float[]>(width * height * 3);
-		float *buffer = buffer_ptr.get();
-
-		for (int y = 0; y < height; y++) {
-			for (int x = 0; x < width; x++) {
-				glm::vec3 color = getAt(x, y);
-				int offset = (y * width + x) * 3;
-
-				buffer[offset] = color[2];
-				buffer[offset + 1] = color[1];
-				buffer[offset + 2] = color[0];
-			}
+	// .ppm and .pfm files are written directly, every other format by the extension through opencv
+	void save(std::string filename) {
+		if(hasExtension(filename, ".ppm")) {
+			write3fPpm(filename);
+			std::cout << "Written to: " << filename << std::endl;
+			return;
 		}
-
-		return buffer_ptr;
-	}
-
-	std::unique_ptr<unsigned char[]> get_3b_bgr_buffer() {
-		auto buffer_ptr = std::make_unique<unsigned char[]>(width * height * 3);
-		unsigned char *buffer = buffer_ptr.get();
-
-		for (int y = 0; y < height; y++) {
-			for (int x = 0; x < width; x++) {
-				glm::vec3 color = getAt(x, y);
-				int offset = (y * width + x) * 3;
-
-				buffer[offset]  = (unsigned char) (clamp(color[2]) * 255);
-				buffer[offset+1]= (unsigned char) (clamp(color[1]) * 255);
-				buffer[offset+2]= (unsigned char) (clamp(color[0]) * 255);
-			}
+		if(hasExtension(filename, ".pfm")) {
+			write3fPfm(filename);
+			std::cout << "Written to: " << filename << std::endl;
+			return;
 		}
 
-		return buffer_ptr;
+		bytes.resize(size_t(width) * height * 3);
+		convertTo8Bit(bytes.data());
+		cv::imwrite(filename, cv::Mat(height, width, CV_8UC3, bytes.data()));
+		std::cout << "Written to: " << filename << std::endl;
 	}
 };
 
@@ -0,0 +1,99 @@
+/*
+ * antialiasing.h
+ *
+ *  Adaptive supersampling: every pixel gets one ray through its center first, only pixels whose color
+ *  or primary hit differs from a neighbour's are traced again with stratified sub-pixel samples.
+ */
+
+#ifndef SRC_ANTIALIASING_H_
+#define SRC_ANTIALIASING_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "geometries.h"
+#include "scheduler.h"
+#include "Image3f.h"
+
+class AdaptiveSampler {
+	int width = 0, height = 0;
+	std::vector<const ITransformedIntersectable*> hitIds;	// geometry of the primary hit, nullptr for misses
+	std::vector<char> edges;								// pixels that get supersampled
+
+	// hashes pixel, sample and dimension to [0, 1), the same jitter for every thread count and tile size
+	static float hash(std::uint32_t x, std::uint32_t y, std::uint32_t sample, std::uint32_t dimension) {
+		std::uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ (2 * sample + dimension) * 0xcb1ab31fu;
+		h ^= h >> 16;
+		h *= 0x7feb352du;
+		h ^= h >> 15;
+		h *= 0x846ca68bu;
+		h ^= h >> 16;
+		return float(h >> 8) * (1.f / 16777216.f);
+	}
+
+	bool differs(int x, int y, int nx, int ny, Image3f &image) const {
+		if(nx < 0 || ny < 0 || nx >= this->width || ny >= this->height) {
+			return false;
+		}
+		if(this->hitIds[size_t(y) * this->width + x] != this->hitIds[size_t(ny) * this->width + nx]) {
+			return true;
+		}
+		const glm::vec3 difference = glm::abs(image.getAt(x, y) - image.getAt(nx, ny));
+		return glm::max(difference[0], glm::max(difference[1], difference[2])) > this->contrastThreshold;
+	}
+
+public:
+	int samplesPerAxis = 1;			// edge pixels get samplesPerAxis x samplesPerAxis samples, 1 turns it off
+	float contrastThreshold = 0.1f;	// largest channel difference to a neighbour that isn't an edge
+
+	bool enabled() const {
+		return this->samplesPerAxis > 1;
+	}
+
+	int sampleCount() const {
+		return this->samplesPerAxis * this->samplesPerAxis;
+	}
+
+	void reset(int width, int height) {
+		this->width = width;
+		this->height = height;
+		this->hitIds.assign(size_t(width) * height, nullptr);
+		this->edges.assign(size_t(width) * height, 0);
+	}
+
+	void setHitId(int x, int y, const ITransformedIntersectable *geometry_ptr) {
+		this->hitIds[size_t(y) * this->width + x] = geometry_ptr;
+	}
+
+	// marks the pixels of tile that differ from one of their four neighbours, returns how many.
+	// Reads neighbours of other tiles, so all tiles have to be traced before and none supersampled yet
+	int markEdges(const Tile &tile, Image3f &image) {
+		int count = 0;
+		for(int y = tile.y0; y < tile.y1; y++) {
+			for(int x = tile.x0; x < tile.x1; x++) {
+				const bool edge = this->differs(x, y, x - 1, y, image) || this->differs(x, y, x + 1, y, image)
+						|| this->differs(x, y, x, y - 1, image) || this->differs(x, y, x, y + 1, image);
+				this->edges[size_t(y) * this->width + x] = edge;
+				count += edge;
+			}
+		}
+		return count;
+	}
+
+	bool isEdge(int x, int y) const {
+		return this->edges[size_t(y) * this->width + x];
+	}
+
+	// image plane position of sample of pixel x, y: jittered within its stratum of the pixel
+	glm::vec2 samplePosition(int x, int y, int sample) const {
+		const float stratumSize = 1.f / this->samplesPerAxis;
+		const int column = sample % this->samplesPerAxis;
+		const int row = sample / this->samplesPerAxis;
+		return glm::vec2(x + (column + hash(x, y, sample, 0)) * stratumSize,
+						 y + (row + hash(x, y, sample, 1)) * stratumSize);
+	}
+};
+
+#endif /* SRC_ANTIALIASING_H_ */
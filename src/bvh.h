@@ -0,0 +1,870 @@
+/*
+ * bvh.h
+ *
+ *  Bounding volume hierarchy built with the surface area heuristic (binned).
+ *  Nodes live in one flat array in depth first order: the left child of an inner
+ *  node directly follows its parent, the right child is referenced by index.
+ */
+
+#ifndef SRC_BVH_H_
+#define SRC_BVH_H_
+
+#include "geometries.h"
+#include "simd.h"
+
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <omp.h>
+
+struct BVHNode {
+	glm::vec3 bounds_min;
+	glm::vec3 bounds_max;
+	int offset;		// leaf: index of first primitive, inner node: index of right child
+	int count;		// number of primitives in leaf, 0 for inner nodes
+	int axis;		// split axis, used to visit the nearer child first
+	int triangleBatch;	// leaf: index into triangleBatches or -1
+	int sphereBatch;	// leaf: index into sphereBatches or -1
+	int scalarOffset;	// leaf: first primitive that is not batched
+};
+
+// stands in for the primitives of a leaf that lost all of them in an update, never hit
+class EmptyPrimitive : public ITransformedIntersectable {
+public:
+	EmptyPrimitive() {
+		this->setTransform(glm::mat4(1.f));
+	};
+
+	virtual HitInfo intersect(glm::vec3 O, glm::vec3 D, int primID) {
+		return HitInfo();
+	};
+
+	virtual bool occluded(glm::vec3 O, glm::vec3 D, int primID, float t_max) {
+		return false;
+	};
+
+	virtual std::pair<glm::vec3, glm::vec3> getExtends(int primID) {
+		return {glm::vec3(0, 0, 0), glm::vec3(0, 0, 0)};
+	};
+};
+
+class BVH : public IIntersectable {
+	friend class SceneCache;	// stores and restores the built tree
+
+	static const int binCount = 16;
+	static const int maxLeafSize = SIMD_WIDTH;	// one batch per leaf
+	static const int maxTreeDepth = 60;
+	static const int stackSize = maxTreeDepth + 4;
+	static const int parallelBuildSize = 4096;	// subtrees with more primitives get built by a task of their own
+	static const int chunkSize = 32768;			// larger ranges get reduced, binned and partitioned in parallel chunks
+
+	// relative costs for the surface area heuristic
+	const float traversalCost = 1.0f;
+	const float intersectionCost = 1.0f;
+
+	std::vector<BVHNode> nodes;
+	std::vector<PrimitiveRef> primitives;	// reordered so that every leaf is a contiguous range
+
+	// SoA leaf primitives for the kernels, the remaining leaf primitives get tested one by one
+	std::vector<TriangleBatch> triangleBatches;
+	std::vector<SphereBatch> sphereBatches;
+
+	// updates give up once the sah cost grew by this factor since the first update
+	const float rebuildThreshold = 1.5f;
+
+	// bookkeeping for updates, set up by the first one
+	std::vector<int> parents;	// -1 for the root
+	std::unordered_map<ITransformedIntersectable*, std::vector<int>> geometryLeaves;	// leaves holding primitives of a geometry
+	double sahSum = 0;			// sah cost times root area, kept up to date on refits
+	float initialCost = 0;
+
+	// per primitive build data
+	struct BuildPrimitive {
+		glm::vec3 bounds_min;
+		glm::vec3 bounds_max;
+		glm::vec3 centroid;
+		PrimitiveRef primitive;
+	};
+
+	struct Bin {
+		glm::vec3 bounds_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+		glm::vec3 bounds_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+		int count = 0;
+
+		void merge(const Bin &other) {
+			bounds_min = glm::min(bounds_min, other.bounds_min);
+			bounds_max = glm::max(bounds_max, other.bounds_max);
+			count += other.count;
+		}
+	};
+
+	// bounds of primitives and of their centroids
+	struct BuildBounds {
+		glm::vec3 bounds_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+		glm::vec3 bounds_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+		glm::vec3 centroid_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+		glm::vec3 centroid_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+
+		void merge(const BuildBounds &other) {
+			bounds_min = glm::min(bounds_min, other.bounds_min);
+			bounds_max = glm::max(bounds_max, other.bounds_max);
+			centroid_min = glm::min(centroid_min, other.centroid_min);
+			centroid_max = glm::max(centroid_max, other.centroid_max);
+		}
+	};
+
+	// bins of all three axes
+	struct AxisBins {
+		Bin bins[3][binCount];
+
+		void merge(const AxisBins &other) {
+			for(int axis = 0; axis < 3; axis++) {
+				for(int b = 0; b < binCount; b++) {
+					bins[axis][b].merge(other.bins[axis][b]);
+				}
+			}
+		}
+	};
+
+
+	static int getChunkCount(int count) {
+		return std::min(count / chunkSize + 1, 4 * omp_get_max_threads());
+	}
+
+	static int chunkStart(int begin, int end, int chunk, int chunkCount) {
+		return begin + int(std::int64_t(end - begin) * chunk / chunkCount);
+	}
+
+	// reduce(chunk_begin, chunk_end, partial) for every chunk of [begin, end), more than one chunk run as
+	// parallel tasks. Returns the partials merged in chunk order
+	template<typename Partial, typename Reduce>
+	static Partial reduceChunks(int begin, int end, Reduce reduce) {
+		const int chunkCount = getChunkCount(end - begin);
+		Partial result;
+		if(chunkCount == 1) {
+			reduce(begin, end, result);
+			return result;
+		}
+
+		std::vector<Partial> partials(chunkCount);
+		#pragma omp taskloop grainsize(1) shared(partials, reduce)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			reduce(chunkStart(begin, end, chunk, chunkCount), chunkStart(begin, end, chunk + 1, chunkCount), partials[chunk]);
+		}
+		for(auto const& partial : partials) {
+			result.merge(partial);
+		}
+		return result;
+	}
+
+	static float surfaceArea(glm::vec3 bounds_min, glm::vec3 bounds_max) {
+		glm::vec3 d = glm::max(bounds_max - bounds_min, glm::vec3(0, 0, 0));
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// builds the subtree for build_prims[begin, end) and returns its node index. Has to run inside a
+	// parallel region, large right subtrees get built by a task into a tree of their own and appended
+	// afterwards, so the node order is the same as for a serial build
+	int build(std::vector<BuildPrimitive> &build_prims, int begin, int end, int depth = 0) {
+		int node_index = int(this->nodes.size());
+		this->nodes.push_back(BVHNode());
+
+		const BuildBounds bounds = reduceChunks<BuildBounds>(begin, end, [&](int chunk_begin, int chunk_end, BuildBounds &partial) {
+			for(int i = chunk_begin; i < chunk_end; i++) {
+				partial.bounds_min = glm::min(partial.bounds_min, build_prims[i].bounds_min);
+				partial.bounds_max = glm::max(partial.bounds_max, build_prims[i].bounds_max);
+				partial.centroid_min = glm::min(partial.centroid_min, build_prims[i].centroid);
+				partial.centroid_max = glm::max(partial.centroid_max, build_prims[i].centroid);
+			}
+		});
+		const glm::vec3 centroid_min = bounds.centroid_min;
+		const glm::vec3 centroid_max = bounds.centroid_max;
+		this->nodes[node_index].bounds_min = bounds.bounds_min;
+		this->nodes[node_index].bounds_max = bounds.bounds_max;
+
+		int count = end - begin;
+		auto [split_axis, split_bin, split_cost] = this->findSplit(build_prims, begin, end, centroid_min, centroid_max,
+				surfaceArea(bounds.bounds_min, bounds.bounds_max));
+		float leaf_cost = intersectionCost * count;
+
+		if(split_axis < 0 || depth >= maxTreeDepth || (count <= maxLeafSize && split_cost >= leaf_cost)) {
+			return this->makeLeaf(build_prims, begin, end, node_index);
+		}
+
+		// partition primitives by bin of their centroid
+		const float extent = centroid_max[split_axis] - centroid_min[split_axis];
+		int mid = this->partition(build_prims, begin, end, [&](const BuildPrimitive &prim) {
+			return this->binIndex(prim.centroid[split_axis], centroid_min[split_axis], extent) <= split_bin;
+		});
+		if(mid == begin || mid == end) {
+			return this->makeLeaf(build_prims, begin, end, node_index);
+		}
+
+		int right_index;
+		if(end - mid > parallelBuildSize && omp_get_num_threads() > 1) {
+			BVH right;
+			#pragma omp task shared(build_prims, right)
+			right.build(build_prims, mid, end, depth + 1);
+
+			this->build(build_prims, begin, mid, depth + 1);
+			#pragma omp taskwait
+			right_index = this->append(right);
+		}
+		else {
+			this->build(build_prims, begin, mid, depth + 1);
+			right_index = this->build(build_prims, mid, end, depth + 1);
+		}
+
+		this->nodes[node_index].offset = right_index;
+		this->nodes[node_index].count = 0;
+		this->nodes[node_index].axis = split_axis;
+		return node_index;
+	}
+
+	// moves the primitives isLeft holds for to the front of build_prims[begin, end), returns where the others
+	// start. Several chunks get partitioned stably: every chunk counts its left primitives, a prefix sum
+	// over the counts gives every chunk the positions it scatters its primitives to
+	template<typename Predicate>
+	int partition(std::vector<BuildPrimitive> &build_prims, int begin, int end, Predicate isLeft) {
+		const int chunkCount = getChunkCount(end - begin);
+		if(chunkCount == 1) {
+			return int(std::partition(build_prims.begin() + begin, build_prims.begin() + end, isLeft) - build_prims.begin());
+		}
+
+		std::vector<int> leftCounts(chunkCount);
+		#pragma omp taskloop grainsize(1) shared(build_prims, leftCounts, isLeft)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			leftCounts[chunk] = int(std::count_if(build_prims.begin() + chunkStart(begin, end, chunk, chunkCount),
+					build_prims.begin() + chunkStart(begin, end, chunk + 1, chunkCount), isLeft));
+		}
+		std::vector<int> leftPositions(chunkCount), rightPositions(chunkCount);
+		int mid = 0;
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			leftPositions[chunk] = mid;
+			mid += leftCounts[chunk];
+		}
+		int position = mid;
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			rightPositions[chunk] = position;
+			position += chunkStart(begin, end, chunk + 1, chunkCount) - chunkStart(begin, end, chunk, chunkCount) - leftCounts[chunk];
+		}
+
+		std::vector<BuildPrimitive> partitioned(end - begin);
+		#pragma omp taskloop grainsize(1) shared(build_prims, partitioned, leftPositions, rightPositions, isLeft)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			for(int i = chunkStart(begin, end, chunk, chunkCount); i < chunkStart(begin, end, chunk + 1, chunkCount); i++) {
+				partitioned[isLeft(build_prims[i]) ? leftPositions[chunk]++ : rightPositions[chunk]++] = build_prims[i];
+			}
+		}
+		#pragma omp taskloop grainsize(1) shared(build_prims, partitioned)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			std::copy(partitioned.begin() + chunkStart(0, end - begin, chunk, chunkCount), partitioned.begin() + chunkStart(0, end - begin, chunk + 1, chunkCount),
+					build_prims.begin() + chunkStart(begin, end, chunk, chunkCount));
+		}
+		return begin + mid;
+	}
+
+	// appends the nodes, primitives and batches of a tree built on its own, returns the index of its root
+	int append(const BVH &other) {
+		const int nodeBase = int(this->nodes.size());
+		const int primitiveBase = int(this->primitives.size());
+		const int triangleBase = int(this->triangleBatches.size());
+		const int sphereBase = int(this->sphereBatches.size());
+		for(BVHNode node : other.nodes) {
+			if(node.count > 0) {
+				node.offset += primitiveBase;
+				node.scalarOffset += primitiveBase;
+				node.triangleBatch += node.triangleBatch >= 0 ? triangleBase : 0;
+				node.sphereBatch += node.sphereBatch >= 0 ? sphereBase : 0;
+			}
+			else {
+				node.offset += nodeBase;
+			}
+			this->nodes.push_back(node);
+		}
+		this->primitives.insert(this->primitives.end(), other.primitives.begin(), other.primitives.end());
+		this->triangleBatches.insert(this->triangleBatches.end(), other.triangleBatches.begin(), other.triangleBatches.end());
+		this->sphereBatches.insert(this->sphereBatches.end(), other.sphereBatches.begin(), other.sphereBatches.end());
+		return nodeBase;
+	}
+
+	int makeLeaf(std::vector<BuildPrimitive> &build_prims, int begin, int end, int node_index) {
+		BVHNode &node = this->nodes[node_index];
+		node.offset = int(this->primitives.size());
+		node.count = 0;
+		node.axis = 0;
+		node.triangleBatch = -1;
+		node.sphereBatch = -1;
+
+		std::vector<PrimitiveRef> leafPrimitives;
+		for(int i = begin; i < end; i++) {
+			leafPrimitives.push_back(build_prims[i].primitive);
+		}
+		this->fillLeaf(node_index, leafPrimitives);
+		return node_index;
+	}
+
+	// stores leafPrimitives in the leaf ordered batched triangles, batched spheres, others. The leaf keeps
+	// its primitive range and batches if they fit, otherwise they get appended
+	void fillLeaf(int node_index, const std::vector<PrimitiveRef> &leafPrimitives) {
+		BVHNode &node = this->nodes[node_index];
+		const int count = int(leafPrimitives.size());
+		if(count > node.count && node.offset + node.count != int(this->primitives.size())) {
+			node.offset = int(this->primitives.size());
+		}
+		if(node.offset + count > int(this->primitives.size())) {
+			this->primitives.resize(node.offset + count);
+		}
+
+		TriangleBatch triangleBatch;
+		SphereBatch sphereBatch;
+		std::vector<PrimitiveRef> scalar;
+		for(auto const& primitive : leafPrimitives) {
+			glm::vec3 A, B, C;
+			float radius;
+			if(triangleBatch.count < SIMD_WIDTH && primitive.geometry_ptr->getWorldTriangle(primitive.primID, A, B, C)) {
+				triangleBatch.add(primitive, A, B, C);
+			}
+			else if(sphereBatch.count < SIMD_WIDTH && primitive.geometry_ptr->getWorldSphere(primitive.primID, A, radius)) {
+				sphereBatch.add(primitive, A, radius);
+			}
+			else {
+				scalar.push_back(primitive);
+			}
+		}
+
+		node.count = count;
+		node.triangleBatch = storeBatch(this->triangleBatches, node.triangleBatch, triangleBatch);
+		node.sphereBatch = storeBatch(this->sphereBatches, node.sphereBatch, sphereBatch);
+		auto next = std::copy(triangleBatch.primitives, triangleBatch.primitives + triangleBatch.count, this->primitives.begin() + node.offset);
+		next = std::copy(sphereBatch.primitives, sphereBatch.primitives + sphereBatch.count, next);
+		node.scalarOffset = int(next - this->primitives.begin());
+		std::copy(scalar.begin(), scalar.end(), next);
+	}
+
+	// puts batch into slot, or appends it if there is none yet. Returns the slot, -1 for empty batches
+	template<typename Batch>
+	static int storeBatch(std::vector<Batch> &batches, int slot, Batch &batch) {
+		if(batch.count == 0) {
+			return -1;
+		}
+		batch.pad();
+		if(slot < 0) {
+			slot = int(batches.size());
+			batches.push_back(batch);
+		}
+		else {
+			batches[slot] = batch;
+		}
+		return slot;
+	}
+
+	inline int binIndex(float centroid, float centroid_min, float extent) {
+		int index = int(binCount * (centroid - centroid_min) / extent);
+		return std::min(std::max(index, 0), binCount - 1);
+	}
+
+	// evaluates the sah for all bin borders on all axes, returns {axis, last bin of left side, cost}
+	std::tuple<int, int, float> findSplit(std::vector<BuildPrimitive> &build_prims, int begin, int end,
+			glm::vec3 centroid_min, glm::vec3 centroid_max, float parent_area) {
+		int best_axis = -1;
+		int best_bin = 0;
+		float best_cost = FLOAT_MAX;
+
+		const glm::vec3 extents = centroid_max - centroid_min;
+		const AxisBins axisBins = reduceChunks<AxisBins>(begin, end, [&](int chunk_begin, int chunk_end, AxisBins &partial) {
+			for(int axis = 0; axis < 3; axis++) {
+				if(extents[axis] <= 0) {
+					continue;
+				}
+				for(int i = chunk_begin; i < chunk_end; i++) {
+					Bin &bin = partial.bins[axis][this->binIndex(build_prims[i].centroid[axis], centroid_min[axis], extents[axis])];
+					bin.count++;
+					bin.bounds_min = glm::min(bin.bounds_min, build_prims[i].bounds_min);
+					bin.bounds_max = glm::max(bin.bounds_max, build_prims[i].bounds_max);
+				}
+			}
+		});
+
+		for(int axis = 0; axis < 3; axis++) {
+			if(extents[axis] <= 0) {
+				continue;
+			}
+
+			const Bin *bins = axisBins.bins[axis];
+
+			// sweep from the right to get area and count of all right sides
+			float right_area[binCount];
+			int right_count[binCount];
+			Bin right;
+			for(int b = binCount - 1; b > 0; b--) {
+				right.count += bins[b].count;
+				right.bounds_min = glm::min(right.bounds_min, bins[b].bounds_min);
+				right.bounds_max = glm::max(right.bounds_max, bins[b].bounds_max);
+				right_area[b] = surfaceArea(right.bounds_min, right.bounds_max);
+				right_count[b] = right.count;
+			}
+
+			// sweep from the left and evaluate split after bin b
+			Bin left;
+			for(int b = 0; b < binCount - 1; b++) {
+				left.count += bins[b].count;
+				left.bounds_min = glm::min(left.bounds_min, bins[b].bounds_min);
+				left.bounds_max = glm::max(left.bounds_max, bins[b].bounds_max);
+				if(left.count == 0 || right_count[b + 1] == 0) {
+					continue;
+				}
+
+				float cost = traversalCost + intersectionCost *
+						(left.count * surfaceArea(left.bounds_min, left.bounds_max) + right_count[b + 1] * right_area[b + 1]) / parent_area;
+				if(cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		return {best_axis, best_bin, best_cost};
+	}
+
+	// slab test, returns entry distance or FLOAT_MAX if the box is missed within (0, t_max)
+	inline float intersectBox(const BVHNode &node, glm::vec3 rayOrigin, glm::vec3 invDir, float t_max) {
+		glm::vec3 t_start = (node.bounds_min - rayOrigin) * invDir;
+		glm::vec3 t_end = (node.bounds_max - rayOrigin) * invDir;
+		glm::vec3 t_near = glm::min(t_start, t_end);
+		glm::vec3 t_far = glm::max(t_start, t_end);
+
+		float t0 = std::max({t_near.x, t_near.y, t_near.z, 0.f});
+		float t1 = std::min({t_far.x, t_far.y, t_far.z, t_max});
+		return t0 <= t1 ? t0 : FLOAT_MAX;
+	}
+
+	static PrimitiveRef emptyLeafPrimitive() {
+		static EmptyPrimitive empty;
+		return {&empty, 0};
+	}
+
+	// contribution of a node to the sah cost times root area
+	double nodeCost(const BVHNode &node) {
+		return surfaceArea(node.bounds_min, node.bounds_max) * (node.count > 0 ? intersectionCost * node.count : traversalCost);
+	}
+
+	float sahCost() {
+		const float rootArea = surfaceArea(this->nodes[0].bounds_min, this->nodes[0].bounds_max);
+		return rootArea > 0 ? float(this->sahSum / rootArea) : 0.f;
+	}
+
+	// parents, leaves per geometry and the sah cost, walks the whole tree once
+	void prepareUpdates() {
+		if(!this->parents.empty()) {
+			return;
+		}
+		this->parents.assign(this->nodes.size(), -1);
+		this->sahSum = 0;
+		for(int node_index = 0; node_index < int(this->nodes.size()); node_index++) {
+			const BVHNode &node = this->nodes[node_index];
+			this->sahSum += this->nodeCost(node);
+			if(node.count == 0) {
+				this->parents[node_index + 1] = node_index;
+				this->parents[node.offset] = node_index;
+				continue;
+			}
+			for(int i = node.offset; i < node.offset + node.count; i++) {
+				std::vector<int> &leaves = this->geometryLeaves[this->primitives[i].geometry_ptr];
+				if(leaves.empty() || leaves.back() != node_index) {
+					leaves.push_back(node_index);
+				}
+			}
+		}
+		this->initialCost = this->sahCost();
+	}
+
+	// leaf whose bounds grow least by including bounds_min, bounds_max
+	int findInsertionLeaf(glm::vec3 bounds_min, glm::vec3 bounds_max) {
+		auto growth = [&](const BVHNode &node) {
+			return surfaceArea(glm::min(node.bounds_min, bounds_min), glm::max(node.bounds_max, bounds_max))
+					- surfaceArea(node.bounds_min, node.bounds_max);
+		};
+		int node_index = 0;
+		while(this->nodes[node_index].count == 0) {
+			const int left = node_index + 1;
+			const int right = this->nodes[node_index].offset;
+			node_index = growth(this->nodes[left]) <= growth(this->nodes[right]) ? left : right;
+		}
+		return node_index;
+	}
+
+	// refills a leaf with its remaining primitives and the inserted ones and recomputes its bounds.
+	// A leaf left without primitives keeps the empty primitive and shrinks to a point within its old bounds
+	void refillLeaf(int node_index, const std::unordered_set<ITransformedIntersectable*> &removed, const std::vector<PrimitiveRef> &inserted) {
+		BVHNode &node = this->nodes[node_index];
+		const PrimitiveRef empty = emptyLeafPrimitive();
+		std::vector<PrimitiveRef> leafPrimitives;
+		for(int i = node.offset; i < node.offset + node.count; i++) {
+			const PrimitiveRef &primitive = this->primitives[i];
+			if(!(primitive == empty) && !removed.contains(primitive.geometry_ptr)) {
+				leafPrimitives.push_back(primitive);
+			}
+		}
+		leafPrimitives.insert(leafPrimitives.end(), inserted.begin(), inserted.end());
+
+		this->sahSum -= this->nodeCost(node);
+		if(leafPrimitives.empty()) {
+			node.bounds_min = node.bounds_max = (node.bounds_min + node.bounds_max) * 0.5f;
+			leafPrimitives.push_back(empty);
+		}
+		else {
+			node.bounds_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+			node.bounds_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+			for(auto const& primitive : leafPrimitives) {
+				auto [start, end] = primitive.getExtends();
+				node.bounds_min = glm::min(node.bounds_min, glm::min(start, end));
+				node.bounds_max = glm::max(node.bounds_max, glm::max(start, end));
+			}
+		}
+		this->fillLeaf(node_index, leafPrimitives);
+		this->sahSum += this->nodeCost(this->nodes[node_index]);
+	}
+
+	// recomputes the bounds of the ancestors of node_index, up to the first one that stays the same
+	void refitAncestors(int node_index) {
+		for(int parent = this->parents[node_index]; parent >= 0; parent = this->parents[parent]) {
+			BVHNode &node = this->nodes[parent];
+			const BVHNode &left = this->nodes[parent + 1];
+			const BVHNode &right = this->nodes[node.offset];
+			const glm::vec3 bounds_min = glm::min(left.bounds_min, right.bounds_min);
+			const glm::vec3 bounds_max = glm::max(left.bounds_max, right.bounds_max);
+			if(bounds_min == node.bounds_min && bounds_max == node.bounds_max) {
+				return;
+			}
+			this->sahSum -= this->nodeCost(node);
+			node.bounds_min = bounds_min;
+			node.bounds_max = bounds_max;
+			this->sahSum += this->nodeCost(node);
+		}
+	}
+
+	BVH() { };	// empty, filled by SceneCache
+
+public:
+	BVH(std::vector<ITransformedIntersectable*> *geometries_ptr) {
+		const std::vector<PrimitiveRef> primitiveRefs = collectPrimitives(geometries_ptr);
+		std::vector<BuildPrimitive> build_prims(primitiveRefs.size());
+		#pragma omp parallel for if(primitiveRefs.size() > chunkSize)
+		for(size_t i = 0; i < primitiveRefs.size(); i++) {
+			auto [start, end] = primitiveRefs[i].getExtends();
+			BuildPrimitive &prim = build_prims[i];
+			prim.bounds_min = glm::min(start, end);
+			prim.bounds_max = glm::max(start, end);
+			prim.centroid = (prim.bounds_min + prim.bounds_max) * 0.5f;
+			prim.primitive = primitiveRefs[i];
+		}
+
+		this->nodes.reserve(2 * build_prims.size() + 1);
+		this->primitives.reserve(build_prims.size());
+		if(build_prims.empty()) {
+			BVHNode empty_leaf;
+			empty_leaf.bounds_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+			empty_leaf.bounds_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+			empty_leaf.offset = 0;
+			empty_leaf.count = 0;
+			empty_leaf.axis = 0;
+			empty_leaf.triangleBatch = -1;
+			empty_leaf.sphereBatch = -1;
+			empty_leaf.scalarOffset = 0;
+			this->nodes.push_back(empty_leaf);
+		}
+		else {
+			#pragma omp parallel if(build_prims.size() > parallelBuildSize)
+			#pragma omp single
+			this->build(build_prims, 0, int(build_prims.size()));
+		}
+		this->nodes.shrink_to_fit();
+	}
+
+	~BVH() { }
+
+private:
+	// tests all primitives of a leaf, updates closest hit and t_max
+	inline void intersectLeaf(const BVHNode &node, glm::vec3 rayOrigin, glm::vec3 rayDir, float &t_max,
+			HitInfo &min_hitInfo, ITransformedIntersectable *&min_geometry_ptr) {
+		COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, node.count);
+		float t_hit;
+		if(node.triangleBatch >= 0) {
+			const TriangleBatch &batch = this->triangleBatches[node.triangleBatch];
+			int lane = batch.intersect(rayOrigin, rayDir, t_max, t_hit);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_geometry_ptr = batch.primitives[lane].geometry_ptr;
+				min_hitInfo = HitInfo(true, t_hit, batch.getNormal(lane), min_geometry_ptr->materialIndex);
+				t_max = t_hit;
+			}
+		}
+		if(node.sphereBatch >= 0) {
+			const SphereBatch &batch = this->sphereBatches[node.sphereBatch];
+			int lane = batch.intersect(rayOrigin, rayDir, t_max, t_hit);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_geometry_ptr = batch.primitives[lane].geometry_ptr;
+				min_hitInfo = HitInfo(true, t_hit, batch.getNormal(lane, rayOrigin + t_hit * rayDir), min_geometry_ptr->materialIndex);
+				t_max = t_hit;
+			}
+		}
+		for(int i = node.scalarOffset; i < node.offset + node.count; i++) {
+			const PrimitiveRef &primitive = this->primitives[i];
+			HitInfo hitInfo = primitive.intersectWorld(rayOrigin, rayDir);
+
+			if(hitInfo.validHit && hitInfo.t < min_hitInfo.t && hitInfo.t < t_max) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_hitInfo = hitInfo;
+				min_geometry_ptr = primitive.geometry_ptr;
+				t_max = hitInfo.t;
+			}
+		}
+	}
+
+	// true on the first primitive of a leaf blocking the ray within (0, t_max)
+	inline bool intersectLeafAny(const BVHNode &node, glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max, PrimitiveRef *occluder) {
+		COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, node.count);
+		int lane;
+		if(node.triangleBatch >= 0 && (lane = this->triangleBatches[node.triangleBatch].occluded(rayOrigin, rayDir, t_max)) >= 0) {
+			if(occluder) *occluder = this->triangleBatches[node.triangleBatch].primitives[lane];
+			return true;
+		}
+		if(node.sphereBatch >= 0 && (lane = this->sphereBatches[node.sphereBatch].occluded(rayOrigin, rayDir, t_max)) >= 0) {
+			if(occluder) *occluder = this->sphereBatches[node.sphereBatch].primitives[lane];
+			return true;
+		}
+		for(int i = node.scalarOffset; i < node.offset + node.count; i++) {
+			if(this->primitives[i].occludedWorld(rayOrigin, rayDir, t_max)) {
+				if(occluder) *occluder = this->primitives[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// closest hit traversal of the subtree below root for a single ray
+	void traverse(int root, glm::vec3 rayOrigin, glm::vec3 rayDir, float &t_max,
+			HitInfo &min_hitInfo, ITransformedIntersectable *&min_geometry_ptr) {
+		const glm::vec3 invDir = 1.f / rayDir;
+		const bool dirNegative[3] = { rayDir.x < 0, rayDir.y < 0, rayDir.z < 0 };
+
+		int stack[stackSize];
+		int stack_ptr = 0;
+		stack[stack_ptr++] = root;
+
+		while(stack_ptr > 0) {
+			const BVHNode &node = this->nodes[stack[--stack_ptr]];
+			COUNT_STATISTIC(STAT_NODES_VISITED, 1);
+			if(this->intersectBox(node, rayOrigin, invDir, t_max) == FLOAT_MAX) {
+				continue;
+			}
+
+			if(node.count > 0) {
+				this->intersectLeaf(node, rayOrigin, rayDir, t_max, min_hitInfo, min_geometry_ptr);
+			}
+			else {
+				// push far child first so the near child gets popped next
+				int near_index = &node - &this->nodes[0] + 1;
+				int far_index = node.offset;
+				if(dirNegative[node.axis]) {
+					std::swap(near_index, far_index);
+				}
+				stack[stack_ptr++] = far_index;
+				stack[stack_ptr++] = near_index;
+			}
+		}
+	}
+
+	// slab test of one node against the rays of a packet in mask, returns mask of rays that hit within their t_max
+	inline std::uint64_t intersectBoxPacket(const BVHNode &node, const RayPacket &packet, const float *t_max, std::uint64_t mask) {
+		const vfloat zero(0.f);
+		const vfloat min_x(node.bounds_min.x - packet.origin.x), max_x(node.bounds_max.x - packet.origin.x);
+		const vfloat min_y(node.bounds_min.y - packet.origin.y), max_y(node.bounds_max.y - packet.origin.y);
+		const vfloat min_z(node.bounds_min.z - packet.origin.z), max_z(node.bounds_max.z - packet.origin.z);
+
+		std::uint64_t hits = 0;
+		for(int lane = 0; lane < packet.size; lane += SIMD_WIDTH) {
+			if(((mask >> lane) & ((std::uint64_t(1) << SIMD_WIDTH) - 1)) == 0) {
+				continue;
+			}
+			const vfloat ix = vfloat::load(packet.invDx + lane), iy = vfloat::load(packet.invDy + lane), iz = vfloat::load(packet.invDz + lane);
+			const vfloat tx0 = min_x * ix, tx1 = max_x * ix;
+			const vfloat ty0 = min_y * iy, ty1 = max_y * iy;
+			const vfloat tz0 = min_z * iz, tz1 = max_z * iz;
+
+			const vfloat t0 = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), zero));
+			const vfloat t1 = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), vfloat::load(t_max + lane)));
+			hits |= std::uint64_t(movemask(t0 <= t1)) << lane;
+		}
+		return hits & mask;
+	}
+
+public:
+	// rays of a packet get traversed together as long as at least this fraction of them is active in a node
+	const float packetCoherence = 0.25f;
+
+	virtual FragmentInfo intersect(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit = FLT_MAX) {
+		HitInfo min_hitInfo;
+		ITransformedIntersectable *min_geometry_ptr = nullptr;
+		float t_max = t_limit;
+
+		this->traverse(0, rayOrigin, rayDir, t_max, min_hitInfo, min_geometry_ptr);
+
+		return toFragmentInfo(rayOrigin, rayDir, min_hitInfo, min_geometry_ptr);
+	};
+
+	// any hit traversal, children are visited in the same near to far order which tends to find occluders early
+	virtual bool occluded(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max = FLT_MAX, PrimitiveRef *occluder = nullptr) {
+		const glm::vec3 invDir = 1.f / rayDir;
+		const bool dirNegative[3] = { rayDir.x < 0, rayDir.y < 0, rayDir.z < 0 };
+
+		int stack[stackSize];
+		int stack_ptr = 0;
+		stack[stack_ptr++] = 0;
+
+		while(stack_ptr > 0) {
+			const int node_index = stack[--stack_ptr];
+			const BVHNode &node = this->nodes[node_index];
+			COUNT_STATISTIC(STAT_NODES_VISITED, 1);
+			if(this->intersectBox(node, rayOrigin, invDir, t_max) == FLOAT_MAX) {
+				continue;
+			}
+
+			if(node.count > 0) {
+				if(this->intersectLeafAny(node, rayOrigin, rayDir, t_max, occluder)) {
+					COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+					return true;
+				}
+			}
+			else {
+				int near_index = node_index + 1;
+				int far_index = node.offset;
+				if(dirNegative[node.axis]) {
+					std::swap(near_index, far_index);
+				}
+				stack[stack_ptr++] = far_index;
+				stack[stack_ptr++] = near_index;
+			}
+		}
+		return false;
+	};
+
+	// closest hits for all rays of a packet with a shared traversal and per ray masks.
+	// Subtrees only few rays of the packet enter are traversed ray by ray.
+	void intersectPacket(const RayPacket &packet, FragmentInfo *fragmentInfos) {
+		HitInfo min_hitInfos[RayPacket::maxSize];
+		ITransformedIntersectable *min_geometry_ptrs[RayPacket::maxSize] = {};
+		alignas(32) float t_max[RayPacket::maxSize];
+		for(int lane = 0; lane < RayPacket::maxSize; lane++) {
+			t_max[lane] = FLT_MAX;
+		}
+
+		const glm::vec3 firstDir = packet.getDirection(0);
+		const bool dirNegative[3] = { firstDir.x < 0, firstDir.y < 0, firstDir.z < 0 };
+		const int minActive = std::max(1, int(packetCoherence * packet.size));
+
+		struct StackEntry {
+			int node_index;
+			std::uint64_t mask;
+		};
+		StackEntry stack[stackSize];
+		int stack_ptr = 0;
+		stack[stack_ptr++] = {0, packet.size == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << packet.size) - 1};
+
+		while(stack_ptr > 0) {
+			StackEntry entry = stack[--stack_ptr];
+			const BVHNode &node = this->nodes[entry.node_index];
+			COUNT_STATISTIC(STAT_NODES_VISITED, 1);
+			std::uint64_t mask = this->intersectBoxPacket(node, packet, t_max, entry.mask);
+			if(mask == 0) {
+				continue;
+			}
+
+			if(node.count > 0 || __builtin_popcountll(mask) < minActive) {
+				// leaf or diverged packet, continue ray by ray
+				for(std::uint64_t m = mask; m; m &= m - 1) {
+					int lane = __builtin_ctzll(m);
+					if(node.count > 0) {
+						this->intersectLeaf(node, packet.origin, packet.getDirection(lane), t_max[lane], min_hitInfos[lane], min_geometry_ptrs[lane]);
+					}
+					else {
+						this->traverse(entry.node_index, packet.origin, packet.getDirection(lane), t_max[lane], min_hitInfos[lane], min_geometry_ptrs[lane]);
+					}
+				}
+				continue;
+			}
+
+			int near_index = entry.node_index + 1;
+			int far_index = node.offset;
+			if(dirNegative[node.axis]) {
+				std::swap(near_index, far_index);
+			}
+			stack[stack_ptr++] = {far_index, mask};
+			stack[stack_ptr++] = {near_index, mask};
+		}
+
+		for(int lane = 0; lane < packet.size; lane++) {
+			fragmentInfos[lane] = toFragmentInfo(packet.origin, packet.getDirection(lane), min_hitInfos[lane], min_geometry_ptrs[lane]);
+		}
+	}
+
+	virtual std::pair<glm::vec3, glm::vec3> getExtends() {
+		return {this->nodes[0].bounds_min, this->nodes[0].bounds_max};
+	};
+
+	// refits in place: the leaves holding changed primitives get refilled, added primitives go into the leaf
+	// whose bounds grow least, then the bounds of their ancestors get recomputed. The tree topology stays
+	// the same, so a rebuild is needed once the sah cost grew by more than rebuildThreshold
+	virtual bool update(const SceneUpdate &update) {
+		if(this->primitives.empty()) {
+			return false;	// nothing to insert into
+		}
+		this->prepareUpdates();
+
+		std::unordered_set<ITransformedIntersectable*> removed;
+		std::map<int, std::vector<PrimitiveRef>> changedLeaves;	// leaf, primitives to insert
+		for(auto const& change : update.moved) {
+			for(int leaf : this->geometryLeaves[change.geometry_ptr]) {
+				changedLeaves[leaf];
+			}
+		}
+		for(auto const& change : update.removed) {
+			removed.insert(change.geometry_ptr);
+			for(int leaf : this->geometryLeaves[change.geometry_ptr]) {
+				changedLeaves[leaf];
+			}
+			this->geometryLeaves.erase(change.geometry_ptr);
+		}
+		for(auto const& geometry_ptr : update.added) {
+			std::vector<int> &leaves = this->geometryLeaves[geometry_ptr];
+			for(int primID = 0; primID < geometry_ptr->getPrimitiveCount(); primID++) {
+				auto [start, end] = geometry_ptr->getExtends(primID);
+				const int leaf = this->findInsertionLeaf(glm::min(start, end), glm::max(start, end));
+				changedLeaves[leaf].push_back({geometry_ptr, primID});
+				if(leaves.empty() || leaves.back() != leaf) {
+					leaves.push_back(leaf);
+				}
+			}
+		}
+
+		// all leaves first, so ancestors shared by several of them are final after their last refit
+		for(auto const& [leaf, inserted] : changedLeaves) {
+			this->refillLeaf(leaf, removed, inserted);
+		}
+		for(auto const& [leaf, inserted] : changedLeaves) {
+			this->refitAncestors(leaf);
+		}
+
+		return this->sahCost() <= rebuildThreshold * this->initialCost;
+	};
+};
+
+#endif /* SRC_BVH_H_ */
@@ -0,0 +1,143 @@
+/*
+ * container.h
+ *
+ *  Brute force intersected list of primitives, used for small scenes and as grid cell.
+ */
+
+#ifndef SRC_CONTAINER_H_
+#define SRC_CONTAINER_H_
+
+#include "geometries.h"
+#include "simd.h"
+
+#include <vector>
+
+class Container : public IIntersectable {
+	std::vector<PrimitiveRef> primitives;		// cells of vectors
+	PrimitiveBatches batches;					// SoA copy of primitives for the kernels, built by pack()
+	bool packed = false;
+public:
+	Container(std::vector<ITransformedIntersectable*> *geometries_ptr) {
+		for(auto const& primitive : collectPrimitives(geometries_ptr)) {
+			this->add(primitive);
+        }
+		this->pack();
+	};
+	Container() { };
+	~Container() { };
+
+	void add(PrimitiveRef primitive) {
+		this->primitives.push_back(primitive);
+		this->packed = false;
+	};
+
+	// (re)builds the SoA batches, call after adding primitives
+	void pack() {
+		this->batches.build(this->primitives);
+		this->packed = true;
+	};
+
+	size_t size() const {
+		return this->primitives.size();
+	};
+
+	std::vector<PrimitiveRef>& getPrimitives() {
+		return this->primitives;
+	};
+
+	// removes all primitives of geometry_ptr, returns how many there were
+	size_t erase(ITransformedIntersectable *geometry_ptr) {
+		size_t count = std::erase_if(this->primitives, [&](const PrimitiveRef &primitive) {
+			return primitive.geometry_ptr == geometry_ptr;
+		});
+		if(count > 0) {
+			this->packed = false;
+		}
+		return count;
+	};
+
+	bool isPacked() const {
+		return this->packed;
+	};
+
+	void clear() {
+		std::vector<PrimitiveRef>().swap(this->primitives);
+		this->batches.clear();
+		this->packed = false;
+	};
+
+	// brute forces all primitives and updates the closest hit found so far (min_hitInfo, min_geometry_ptr).
+	// Primitives already marked in the mailbox get skipped.
+	inline void intersectClosest(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit,
+			HitInfo &min_hitInfo, ITransformedIntersectable *&min_geometry_ptr, Mailbox *mailbox = nullptr) {
+		if(this->packed) {
+			this->batches.intersectClosest(rayOrigin, rayDir, t_limit, min_hitInfo, min_geometry_ptr, mailbox);
+			return;
+		}
+
+        for(auto const& primitive : this->primitives)  {
+            if(mailbox && mailbox->testAndSet(primitive)) {
+            	continue;
+            }
+
+            HitInfo hitInfo = primitive.intersectWorld(rayOrigin, rayDir);
+            COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, 1);
+
+            if(hitInfo.validHit && hitInfo.t < min_hitInfo.t && hitInfo.t < t_limit) {
+            	COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+            	min_hitInfo = hitInfo;
+            	min_geometry_ptr = primitive.geometry_ptr;
+            }
+        }
+	};
+
+	// stops at the first primitive blocking the ray within (0, t_limit)
+	inline bool intersectAny(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit,
+			PrimitiveRef *occluder = nullptr, Mailbox *mailbox = nullptr) {
+		if(this->packed) {
+			return this->batches.intersectAny(rayOrigin, rayDir, t_limit, occluder, mailbox);
+		}
+
+        for(auto const& primitive : this->primitives)  {
+            if(mailbox && mailbox->testAndSet(primitive)) {
+            	continue;
+            }
+            COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, 1);
+            if(primitive.occludedWorld(rayOrigin, rayDir, t_limit)) {
+            	COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+            	if(occluder) *occluder = primitive;
+            	return true;
+            }
+        }
+        return false;
+	};
+
+	virtual FragmentInfo intersect(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit = FLT_MAX) {
+		// all geometries in cell get brute forced
+        HitInfo min_hitInfo;
+        ITransformedIntersectable *min_geometry_ptr = nullptr;
+        this->intersectClosest(rayOrigin, rayDir, t_limit, min_hitInfo, min_geometry_ptr);
+
+        return toFragmentInfo(rayOrigin, rayDir, min_hitInfo, min_geometry_ptr);
+	};
+
+	virtual bool occluded(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max = FLT_MAX, PrimitiveRef *occluder = nullptr) {
+		return this->intersectAny(rayOrigin, rayDir, t_max, occluder);
+	};
+
+	// brute force has no bounds to refit, only the batches hold copies of the moved shapes
+	virtual bool update(const SceneUpdate &update) {
+		for(auto const& change : update.removed) {
+			this->erase(change.geometry_ptr);
+		}
+		for(auto const& geometry_ptr : update.added) {
+			for(int primID = 0; primID < geometry_ptr->getPrimitiveCount(); primID++) {
+				this->add({geometry_ptr, primID});
+			}
+		}
+		this->pack();
+		return true;
+	};
+};
+
+#endif /* SRC_CONTAINER_H_ */
@@ -0,0 +1,423 @@
+/*
+ * distributed.h
+ *
+ *  Renders frames on several worker processes. A coordinator hands out tiles over TCP, every worker
+ *  loads the scene itself, renders the tiles with all its threads and sends back the pixels.
+ *  POSIX sockets only, coordinator and workers have to share the byte order and the scene files.
+ */
+
+#ifndef SRC_DISTRIBUTED_H_
+#define SRC_DISTRIBUTED_H_
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RAYTRACER_DISTRIBUTED 1
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "geometries.h"
+#include "scheduler.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+extern char **environ;
+
+enum class MessageType : std::uint32_t {
+	JOB = 1,	// coordinator -> worker: WorkerJob and the scene path, sent before the tiles of every frame
+	TILE,		// coordinator -> worker: TileMessage
+	RESULT,		// worker -> coordinator: TileMessage and the RGB floats of the tile, row by row
+	DONE,		// coordinator -> worker: no more frames, the worker exits
+};
+
+// what a worker needs to render tiles of a frame like the coordinator would
+struct WorkerJob {
+	std::int32_t accelerationType;
+	std::int32_t width, height;		// resolution of the frame, the scene file's one may be overridden
+	std::int32_t packetSize;
+	std::int32_t tileSize;			// workers split the tiles they get into tiles of this size for their threads
+	std::int32_t useSceneCache;
+	float minThroughput;
+	float lightThreshold;
+	Camera camera;					// view of the frame, the scene is loaded once for all frames
+};
+
+struct TileMessage {
+	std::int32_t id;
+	Tile tile;
+};
+
+// a blocking message connection, every message is a type, a payload size and the payload
+class Connection {
+	int fd;
+
+	bool sendAll(const void *data, size_t size) {
+		const char *bytes = static_cast<const char*>(data);
+		while(size > 0) {
+			ssize_t sent = ::send(this->fd, bytes, size, MSG_NOSIGNAL);
+			if(sent <= 0) {
+				return false;
+			}
+			bytes += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	bool receiveAll(void *data, size_t size) {
+		char *bytes = static_cast<char*>(data);
+		while(size > 0) {
+			ssize_t received = ::recv(this->fd, bytes, size, 0);
+			if(received <= 0) {
+				return false;
+			}
+			bytes += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+public:
+	explicit Connection(int fd) : fd(fd) {
+		int on = 1;
+		::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	};
+
+	~Connection() {
+		::close(this->fd);
+	};
+
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+
+	// nullptr if host:port can't be reached
+	static std::unique_ptr<Connection> connectTo(const std::string &host, const std::string &port) {
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo *addresses = nullptr;
+		if(::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+			return nullptr;
+		}
+		int fd = -1;
+		for(addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+			fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if(fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+				::close(fd);
+				fd = -1;
+			}
+		}
+		::freeaddrinfo(addresses);
+		return fd >= 0 ? std::make_unique<Connection>(fd) : nullptr;
+	};
+
+	int descriptor() const {
+		return this->fd;
+	};
+
+	// a peer that stalls in the middle of a message for this long counts as dead
+	void setTimeout(int seconds) {
+		timeval timeout = { seconds, 0 };
+		::setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		::setsockopt(this->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	};
+
+	bool send(MessageType type, const void *payload, size_t size, const void *extra = nullptr, size_t extraSize = 0) {
+		const std::uint32_t header[2] = { std::uint32_t(type), std::uint32_t(size + extraSize) };
+		return this->sendAll(header, sizeof(header)) && this->sendAll(payload, size) && this->sendAll(extra, extraSize);
+	};
+
+	bool receive(MessageType &type, std::vector<char> &payload) {
+		std::uint32_t header[2];
+		if(!this->receiveAll(header, sizeof(header))) {
+			return false;
+		}
+		type = MessageType(header[0]);
+		payload.resize(header[1]);
+		return this->receiveAll(payload.data(), payload.size());
+	};
+};
+
+// Hands out the tiles of a frame to the connected workers, a few at a time so they never wait for the
+// next one. Workers can connect at any time, even between frames. The tiles of a worker that
+// disconnects or stalls are put back at the front of the queue and go to the next free worker.
+class TileCoordinator {
+	struct Worker {
+		std::unique_ptr<Connection> connection;
+		std::deque<int> tiles;	// sent but not yet returned
+		int frame = -1;			// last frame the job was sent for
+		int tilesRendered = 0;
+		std::chrono::steady_clock::time_point lastResult;
+	};
+
+	static const int tilesInFlight = 2;
+	static constexpr int stallSeconds = 60;
+
+	int listenFd = -1;
+	int port = 0;
+	std::vector<Worker> workers;
+	int workersSeen = 0;
+	int frame = 0;
+
+	void accept() {
+		int fd = ::accept(this->listenFd, nullptr, nullptr);
+		if(fd < 0) {
+			return;
+		}
+		Worker worker;
+		worker.connection = std::make_unique<Connection>(fd);
+		worker.connection->setTimeout(stallSeconds);
+		worker.lastResult = std::chrono::steady_clock::now();
+		this->workers.push_back(std::move(worker));
+		std::cout << "worker " << this->workersSeen++ << " connected" << std::endl;
+	}
+
+	// closes the connection of worker, its unfinished tiles are rendered again by others
+	void drop(int index, std::deque<int> &pending) {
+		Worker &worker = this->workers[index];
+		std::cout << "lost a worker, reissuing " << worker.tiles.size() << " tiles" << std::endl;
+		pending.insert(pending.begin(), worker.tiles.begin(), worker.tiles.end());
+		this->workers.erase(this->workers.begin() + index);
+	}
+
+	// sends the job if the worker hasn't got it yet and tops up its tiles, false if the worker is gone
+	bool assign(Worker &worker, std::deque<int> &pending, const std::vector<Tile> &tiles,
+				const WorkerJob &job, const std::string &scenePath) {
+		if(worker.frame != this->frame) {
+			if(!worker.connection->send(MessageType::JOB, &job, sizeof(job), scenePath.data(), scenePath.size())) {
+				return false;
+			}
+			worker.frame = this->frame;
+		}
+		if(worker.tiles.empty()) {
+			worker.lastResult = std::chrono::steady_clock::now();
+		}
+		while(int(worker.tiles.size()) < tilesInFlight && !pending.empty()) {
+			TileMessage message = { pending.front(), tiles[pending.front()] };
+			worker.tiles.push_back(pending.front());
+			pending.pop_front();
+			if(!worker.connection->send(MessageType::TILE, &message, sizeof(message))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+public:
+	// listens on all interfaces, port 0 picks a free one
+	TileCoordinator(int port) {
+		this->listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+		if(this->listenFd < 0) {
+			return;
+		}
+		int on = 1;
+		::setsockopt(this->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(std::uint16_t(port));
+		socklen_t length = sizeof(address);
+		if(::bind(this->listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+				|| ::listen(this->listenFd, 64) != 0
+				|| ::getsockname(this->listenFd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+			::close(this->listenFd);
+			this->listenFd = -1;
+			return;
+		}
+		this->port = ntohs(address.sin_port);
+	};
+
+	~TileCoordinator() {
+		this->finish();
+		if(this->listenFd >= 0) {
+			::close(this->listenFd);
+		}
+	};
+
+	bool isListening() const {
+		return this->listenFd >= 0;
+	};
+
+	int getPort() const {
+		return this->port;
+	};
+
+	// renders tiles on the workers, waiting for workers as long as there are none.
+	// onResult(const Tile&, const float *rgb) gets every tile exactly once, on the calling thread
+	template<typename ResultHandler>
+	void run(const std::vector<Tile> &tiles, const WorkerJob &job, const std::string &scenePath, ResultHandler onResult) {
+		this->frame++;
+		std::deque<int> pending;
+		for(int i = 0; i < int(tiles.size()); i++) {
+			pending.push_back(i);
+		}
+		std::vector<bool> done(tiles.size(), false);
+		int remaining = int(tiles.size());
+		bool waiting = false;
+
+		std::vector<pollfd> descriptors;
+		std::vector<char> payload;
+		while(remaining > 0) {
+			for(int i = int(this->workers.size()) - 1; i >= 0; i--) {
+				if(!this->assign(this->workers[i], pending, tiles, job, scenePath)) {
+					this->drop(i, pending);
+				}
+			}
+			if(this->workers.empty() && !waiting) {
+				std::cout << "waiting for workers on port " << this->port << std::endl;
+			}
+			waiting = this->workers.empty();
+
+			descriptors.assign(1, { this->listenFd, POLLIN, 0 });
+			for(auto const& worker : this->workers) {
+				descriptors.push_back({ worker.connection->descriptor(), POLLIN, 0 });
+			}
+			if(::poll(descriptors.data(), descriptors.size(), 1000) < 0) {
+				continue;
+			}
+
+			// workers in reverse, so dropping one doesn't shift the ones still to check
+			const auto now = std::chrono::steady_clock::now();
+			for(int i = int(this->workers.size()) - 1; i >= 0; i--) {
+				if(!descriptors[i + 1].revents) {
+					if(!this->workers[i].tiles.empty() && now - this->workers[i].lastResult > std::chrono::seconds(stallSeconds)) {
+						this->drop(i, pending);
+					}
+					continue;
+				}
+				Worker &worker = this->workers[i];
+				MessageType type;
+				if(!worker.connection->receive(type, payload) || type != MessageType::RESULT || payload.size() < sizeof(TileMessage)) {
+					this->drop(i, pending);
+					continue;
+				}
+
+				TileMessage message;
+				std::memcpy(&message, payload.data(), sizeof(message));
+				// the id comes off the socket, only tiles sent to this worker are looked up
+				auto sent = std::find(worker.tiles.begin(), worker.tiles.end(), message.id);
+				if(sent == worker.tiles.end() || message.id < 0 || size_t(message.id) >= tiles.size()) {
+					this->drop(i, pending);
+					continue;
+				}
+				const Tile &tile = tiles[message.id];
+				const size_t pixelBytes = size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * 3 * sizeof(float);
+				if(payload.size() != sizeof(message) + pixelBytes) {
+					this->drop(i, pending);
+					continue;
+				}
+				worker.tiles.erase(sent);
+				worker.tilesRendered++;
+				worker.lastResult = now;
+
+				if(!done[message.id]) {
+					done[message.id] = true;
+					remaining--;
+					onResult(tile, reinterpret_cast<const float*>(payload.data() + sizeof(message)));
+				}
+			}
+			if(descriptors[0].revents & POLLIN) {
+				this->accept();
+			}
+		}
+	};
+
+	void printStatistics(std::ostream &out = std::cout) const {
+		for(size_t i = 0; i < this->workers.size(); i++) {
+			out << "worker " << i << ": " << this->workers[i].tilesRendered << " tiles" << std::endl;
+		}
+	};
+
+	// tells all workers to exit
+	void finish() {
+		for(auto const& worker : this->workers) {
+			worker.connection->send(MessageType::DONE, nullptr, 0);
+		}
+		this->workers.clear();
+	};
+};
+
+// Connects to the coordinator at host:port and renders tiles until it is told to stop or loses the connection.
+// loadJob(const WorkerJob&, const std::string &scenePath) prepares a frame and returns false if it can't,
+// renderTile(const Tile&, std::vector<float> &rgb) fills rgb with the RGB floats of the tile, row by row
+template<typename JobLoader, typename TileRenderer>
+bool runWorker(const std::string &host, const std::string &port, JobLoader loadJob, TileRenderer renderTile) {
+	std::unique_ptr<Connection> connection = Connection::connectTo(host, port);
+	if(!connection) {
+		std::cout << "could not connect to " << host << ":" << port << std::endl;
+		return false;
+	}
+
+	MessageType type;
+	std::vector<char> payload;
+	std::vector<float> rgb;
+	while(connection->receive(type, payload)) {
+		if(type == MessageType::DONE) {
+			return true;
+		}
+		else if(type == MessageType::JOB && payload.size() >= sizeof(WorkerJob)) {
+			WorkerJob job;
+			std::memcpy(&job, payload.data(), sizeof(job));
+			if(!loadJob(job, std::string(payload.begin() + sizeof(job), payload.end()))) {
+				return false;
+			}
+		}
+		else if(type == MessageType::TILE && payload.size() == sizeof(TileMessage)) {
+			TileMessage message;
+			std::memcpy(&message, payload.data(), sizeof(message));
+			renderTile(message.tile, rgb);
+			if(!connection->send(MessageType::RESULT, &message, sizeof(message), rgb.data(), rgb.size() * sizeof(float))) {
+				return false;
+			}
+		}
+	}
+	std::cout << "lost the connection to the coordinator" << std::endl;
+	return false;
+}
+
+// starts count processes of executable working for the coordinator on localhost:port, threadCount <= 0 uses all threads
+inline std::vector<pid_t> spawnLocalWorkers(const std::string &executable, int port, int count, int threadCount) {
+	std::vector<pid_t> workers;
+	const std::string address = "127.0.0.1:" + std::to_string(port);
+	const std::string threads = std::to_string(threadCount);
+	for(int i = 0; i < count; i++) {
+		const char *arguments[] = { executable.c_str(), "--worker", address.c_str(), "--threads", threads.c_str(), nullptr };
+		pid_t pid;
+		if(::posix_spawnp(&pid, executable.c_str(), nullptr, nullptr, const_cast<char**>(arguments), environ) == 0) {
+			workers.push_back(pid);
+		}
+		else {
+			std::cout << "could not start worker " << executable << std::endl;
+		}
+	}
+	return workers;
+}
+
+inline void waitForLocalWorkers(const std::vector<pid_t> &workers) {
+	for(pid_t pid : workers) {
+		::waitpid(pid, nullptr, 0);
+	}
+}
+
+#endif
+
+#endif /* SRC_DISTRIBUTED_H_ */
@@ -12,6 +12,9 @@
 #include <vector>
 #include <string>
 #include <stack>
+#include <array>
+#include <cstdint>
+#include <limits>
 
 #include <glm/glm.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
@@ -53,6 +56,12 @@ struct Material {
         this->emissionColor = emissionColor;
         this->shininess = shininess;
 	};
+
+	bool operator==(const Material &other) const {
+		return this->ambientColor == other.ambientColor && this->diffuseColor == other.diffuseColor
+			&& this->specularColor == other.specularColor && this->emissionColor == other.emissionColor
+			&& this->shininess == other.shininess;
+	};
 };
 
 // intersection info for object space
@@ -60,46 +69,68 @@ struct HitInfo {
 	bool validHit;
 	float t; 		  // t hit for ray (world space and sphere space)
 	glm::vec3 normal; // normal for fragment hit in sphere(object) space
-	Material *material;
+	int materialIndex; // index into the material table of the scene
 
 	HitInfo() {
 		this->validHit = false;
 		this->normal = glm::vec3();
 		this->t = FLOAT_MAX;
-		material = NULL;
+		materialIndex = -1;
 	}
 
-	HitInfo(bool validHit, float t, glm::vec3 normal, Material *material) : HitInfo() {
+	HitInfo(bool validHit, float t, glm::vec3 normal, int materialIndex) : HitInfo() {
 		this->validHit = t > 0 ? validHit : false;
 		this->normal = normal;
 		this->t = only_positive_scalar(t);
-		this->material = material;
+		this->materialIndex = materialIndex;
 	}
 };
 
 // convenience structure -> type safety for intersection info for world space
+struct ITransformedIntersectable;
+
 struct FragmentInfo {
 	bool validHit = false;
 	float t;				// length on ray the intersection occurred at
 	glm::vec3 position;		// fragment position in world space
 	glm::vec3 normal;		// normal in world space
-	Material *material;
+	int materialIndex;		// index into the material table of the scene
+	ITransformedIntersectable *geometry_ptr = nullptr;	// geometry hit, tells objects apart
 
 	FragmentInfo() {
         this->validHit = false;
         this->t = FLOAT_MAX;
         this->position = glm::vec3();
         this->normal = glm::vec3();
-        this->material = NULL;
+        this->materialIndex = -1;
 	}
 
 	// convenience constructor
-	FragmentInfo(bool validHit, float t, glm::vec3 position, glm::vec3 normal, Material *material) : FragmentInfo() {
+	FragmentInfo(bool validHit, float t, glm::vec3 position, glm::vec3 normal, int materialIndex) : FragmentInfo() {
         this->validHit = t > 0 ? validHit : false;
         this->t = only_positive_scalar(t);
         this->position = position;
         this->normal = normal;
-        this->material = material;
+        this->materialIndex = materialIndex;
+	}
+};
+
+struct PrimitiveRef;
+
+// geometries that changed since an acceleration structure was built or last updated
+struct SceneUpdate {
+	// a geometry that was part of the structure, with the world bounds it had there
+	struct Change {
+		ITransformedIntersectable *geometry_ptr;
+		glm::vec3 bounds_min;
+		glm::vec3 bounds_max;
+	};
+	std::vector<Change> moved;		// shape changed in place, see ITransformedIntersectable::applyTransform
+	std::vector<Change> removed;	// still alive until the update is applied
+	std::vector<ITransformedIntersectable*> added;
+
+	bool empty() const {
+		return this->moved.empty() && this->removed.empty() && this->added.empty();
 	}
 };
 
@@ -107,16 +138,96 @@ struct IIntersectable {
 	IIntersectable() {}
 	virtual ~IIntersectable() {};
 	virtual FragmentInfo intersect(glm::vec3 O, glm::vec3 D, float t_limit = FLT_MAX) = 0;
+	// any hit query for shadow rays: true as soon as some primitive blocks the ray within (0, t_max),
+	// the blocking primitive is stored in occluder if given
+	virtual bool occluded(glm::vec3 O, glm::vec3 D, float t_max = FLT_MAX, PrimitiveRef *occluder = nullptr) = 0;
+	// applies update in place at a cost that depends on the changed geometries only. Returns false if
+	// the structure can't follow or got too slow to traverse, it has to be rebuilt then
+	virtual bool update(const SceneUpdate &update) {
+		return false;
+	};
 };
 
 struct ITransformedIntersectable {
 	ITransformedIntersectable() {}
 	virtual ~ITransformedIntersectable() {};
-	virtual HitInfo intersect(glm::vec3 O, glm::vec3 D) = 0;
-	virtual std::pair<glm::vec3, glm::vec3> getExtends() = 0;
+	// primID addresses a single primitive for geometries made of several (meshes), see getPrimitiveCount
+	virtual HitInfo intersect(glm::vec3 O, glm::vec3 D, int primID) = 0;
+	virtual std::pair<glm::vec3, glm::vec3> getExtends(int primID) = 0;
+	// true if the primitive blocks the ray within (0, t_max), override to skip computing the normal
+	virtual bool occluded(glm::vec3 O, glm::vec3 D, int primID, float t_max) {
+		HitInfo hitInfo = this->intersect(O, D, primID);
+		return hitInfo.validHit && hitInfo.t > 0 && hitInfo.t < t_max;
+	};
+	virtual int getPrimitiveCount() {
+		return 1;
+	};
+
+	// world space shape for the vectorized kernels, only available for primitives without transform
+	virtual bool getWorldTriangle(int primID, glm::vec3 &A, glm::vec3 &B, glm::vec3 &C) {
+		return false;
+	};
+	virtual bool getWorldSphere(int primID, glm::vec3 &center, float &radius) {
+		return false;
+	};
 
-	Material material;
-	glm::mat4 transform;
+	int materialIndex = -1;		// index into the material table of the scene
+	glm::mat4 transform;		// object to world, only set through setTransform so the cached matrices stay valid
+	glm::mat4 inverseTransform;	// world to object
+	glm::mat3 normalMatrix;		// transpose(inverse(transform)) for object to world normals
+	bool hasTransform = false;	// false if transform is the identity, rays and normals don't need transforming
+
+	void setTransform(glm::mat4 transform) {
+		this->transform = transform;
+		this->inverseTransform = glm::inverse(transform);
+		this->normalMatrix = glm::mat3(glm::transpose(this->inverseTransform));
+		this->hasTransform = transform != glm::mat4(1.f);
+	}
+
+	// moves the geometry by transform, applied in world space after the current transform. Geometries
+	// baking their transform override this to keep world space data where possible
+	virtual void applyTransform(glm::mat4 transform) {
+		this->setTransform(transform * this->transform);
+	}
+
+	// world bounds of all primitives
+	std::pair<glm::vec3, glm::vec3> getBounds() {
+		glm::vec3 bounds_min = glm::vec3(1, 1, 1) * FLOAT_MAX;
+		glm::vec3 bounds_max = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+		for(int primID = 0; primID < this->getPrimitiveCount(); primID++) {
+			auto [start, end] = this->getExtends(primID);
+			bounds_min = glm::min(bounds_min, start);
+			bounds_max = glm::max(bounds_max, end);
+		}
+		return {bounds_min, bounds_max};
+	}
+
+	// true if the transform has no projective part (last row is 0, 0, 0, 1)
+	bool isAffine(glm::mat4 transform) {
+		return transform[0][3] == 0 && transform[1][3] == 0 && transform[2][3] == 0 && transform[3][3] == 1;
+	}
+
+	// intersects a world space ray, t stays valid in world space since rayDir is not renormalized
+	inline HitInfo intersectWorld(glm::vec3 rayOrigin, glm::vec3 rayDir, int primID) {
+		if(!this->hasTransform) {
+			return this->intersect(rayOrigin, rayDir, primID);
+		}
+		return this->intersect(transformPoint(this->inverseTransform, rayOrigin), transformDirection(this->inverseTransform, rayDir), primID);
+	}
+
+	inline bool occludedWorld(glm::vec3 rayOrigin, glm::vec3 rayDir, int primID, float t_max) {
+		if(!this->hasTransform) {
+			return this->occluded(rayOrigin, rayDir, primID, t_max);
+		}
+		return this->occluded(transformPoint(this->inverseTransform, rayOrigin), transformDirection(this->inverseTransform, rayDir), primID, t_max);
+	}
+
+	inline glm::vec3 normalToWorld(glm::vec3 normal) {
+		if(!this->hasTransform) {
+			return glm::normalize(normal);
+		}
+		return glm::normalize(this->normalMatrix * normal);
+	}
 
 	// get all 8 corners from bounding box definition start, end
 	std::array<glm::vec3, 8> eightCornersFromBoundingBox(glm::vec3 start, glm::vec3 end) {
@@ -144,7 +255,7 @@ struct ITransformedIntersectable {
         //      glm::vec3(start.x, end.y, end.z) };
 
 		glm::vec3 min_start = glm::vec3(1, 1, 1) * FLOAT_MAX;
-		glm::vec3 max_end = glm::vec3(1, 1, 1) * FLOAT_MIN;
+		glm::vec3 max_end = glm::vec3(1, 1, 1) * -FLOAT_MAX;
 		for(auto point : this->eightCornersFromBoundingBox(start, end)) {
 			auto p = transformPoint(this->transform, point);
 			min_start = glm::min(min_start, p);
@@ -155,70 +266,143 @@ struct ITransformedIntersectable {
 	};
 };
 
-class Container : public IIntersectable {
-	std::vector<ITransformedIntersectable*> geometries;		// cells of vectors
-public:
-	Container(std::vector<ITransformedIntersectable*> *geometries_ptr) {
-		for(auto const& geometry_ptr : *geometries_ptr) {
-			this->add(geometry_ptr);
-        }
-	};
-	Container() { };
-	~Container() { };
+// a single primitive of a geometry, this is what acceleration structures store and intersect
+struct PrimitiveRef {
+	ITransformedIntersectable *geometry_ptr;
+	int primID;
 
-	void add(ITransformedIntersectable* geometry_ptr) {
-		this->geometries.push_back(geometry_ptr);
-	};
+	inline HitInfo intersectWorld(glm::vec3 rayOrigin, glm::vec3 rayDir) const {
+		return this->geometry_ptr->intersectWorld(rayOrigin, rayDir, this->primID);
+	}
 
-	virtual FragmentInfo intersect(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit = FLT_MAX) {
-		// all geometries in cell get brute forced
-        HitInfo min_hitInfo;
-        ITransformedIntersectable *min_geometry_ptr;
-        for(auto const& geometry_ptr : this->geometries)  {
+	inline bool occludedWorld(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max) const {
+		return this->geometry_ptr->occludedWorld(rayOrigin, rayDir, this->primID, t_max);
+	}
 
-            const glm::vec3 rayOrigin_os = transformPoint(glm::inverse(geometry_ptr->transform), rayOrigin);
-            glm::vec3 rayDir_os = transformDirection(glm::inverse(geometry_ptr->transform), rayDir);
-            HitInfo hitInfo = geometry_ptr->intersect(rayOrigin_os, rayDir_os);
+	inline std::pair<glm::vec3, glm::vec3> getExtends() const {
+		return this->geometry_ptr->getExtends(this->primID);
+	}
 
-            // has to be intersection at current cell
-            if(hitInfo.validHit && hitInfo.t < min_hitInfo.t && hitInfo.t < t_limit) {
-            	min_hitInfo = hitInfo;
-            	min_geometry_ptr = geometry_ptr;
-            }
-        }
+	bool operator==(const PrimitiveRef &other) const {
+		return this->geometry_ptr == other.geometry_ptr && this->primID == other.primID;
+	}
+};
 
-        if(min_hitInfo.validHit) {
-        	// return FragmentInfo(true, min_hitInfo.t,
-        	// 		rayOrigin + min_hitInfo.t * rayDir,
-			// 		normalTransform(min_geometry_ptf->transform, min_hitInfo.normal),
-			// 		min_hitInfo.material);
-			FragmentInfo fragmentInfo;
-			fragmentInfo.validHit = true;
-			fragmentInfo.t = min_hitInfo.t;
-			fragmentInfo.position = rayOrigin + min_hitInfo.t * rayDir;
-			fragmentInfo.normal = normalTransform(min_geometry_ptr->transform, min_hitInfo.normal);
-			fragmentInfo.material = min_hitInfo.material;
-			return fragmentInfo;
-        }
-        return FragmentInfo();
-	};
+// expands geometries into their single primitives
+inline std::vector<PrimitiveRef> collectPrimitives(std::vector<ITransformedIntersectable*> *geometries_ptr) {
+	std::vector<PrimitiveRef> primitives;
+	for(auto const& geometry_ptr : *geometries_ptr) {
+		for(int primID = 0; primID < geometry_ptr->getPrimitiveCount(); primID++) {
+			primitives.push_back({geometry_ptr, primID});
+		}
+	}
+	return primitives;
+}
+
+// builds the world space fragment for the closest object space hit of a ray
+inline FragmentInfo toFragmentInfo(glm::vec3 rayOrigin, glm::vec3 rayDir, const HitInfo &hitInfo, ITransformedIntersectable *geometry_ptr) {
+	if(!hitInfo.validHit) {
+		return FragmentInfo();
+	}
+	FragmentInfo fragmentInfo;
+	fragmentInfo.validHit = true;
+	fragmentInfo.t = hitInfo.t;
+	fragmentInfo.position = rayOrigin + hitInfo.t * rayDir;
+	fragmentInfo.normal = geometry_ptr->normalToWorld(hitInfo.normal);
+	fragmentInfo.materialIndex = hitInfo.materialIndex;
+	fragmentInfo.geometry_ptr = geometry_ptr;
+	return fragmentInfo;
+}
+
+// per ray record of already tested primitives, so primitives that overlap several grid cells
+// are only intersected once. Direct mapped, a collision only costs a repeated test.
+struct Mailbox {
+	static const int size = 64;
+	PrimitiveRef entries[size] = {};
+
+	// returns true if primitive was already tested with this ray, marks it as tested otherwise
+	inline bool testAndSet(const PrimitiveRef &primitive) {
+		std::uintptr_t key = reinterpret_cast<std::uintptr_t>(primitive.geometry_ptr);
+		int index = int((key >> 4) ^ (key >> 10) ^ std::uintptr_t(primitive.primID)) & (size - 1);
+		if(this->entries[index] == primitive) {
+			return true;
+		}
+		this->entries[index] = primitive;
+		return false;
+	}
 };
 
+// per thread record of the primitive that last blocked a shadow ray towards each light. Neighbouring
+// shading points mostly share their occluder, so it gets tested before the scene is traversed.
+struct alignas(64) OccluderCache {
+	std::vector<PrimitiveRef> lastOccluder;		// per light, geometry_ptr is null while there is none
 
+	OccluderCache(size_t lightCount = 0) : lastOccluder(lightCount, PrimitiveRef{nullptr, 0}) {}
+
+	inline bool occluded(IIntersectable *scene_content, int light, glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max = FLT_MAX) {
+		PrimitiveRef &occluder = this->lastOccluder[light];
+		if(occluder.geometry_ptr && occluder.occludedWorld(rayOrigin, rayDir, t_max)) {
+			return true;
+		}
+		return scene_content->occluded(rayOrigin, rayDir, t_max, &occluder);
+	}
+};
 
 class Sphere : public ITransformedIntersectable {
+	friend class SceneCache;
 private:
 	glm::vec3 center;
 	float radius;
 public:
-	Sphere(const glm::vec3 center, const float radius, Material material, glm::mat4 transform) {
+	Sphere(const glm::vec3 center, const float radius, int materialIndex, glm::mat4 transform) {
 		this->center = center;
 		this->radius = radius;
-		this->material = material;
-		this->transform = transform;
+		this->materialIndex = materialIndex;
+
+		float scale;
+		if(this->isSimilarity(transform, scale)) {
+			// rotation, uniform scale and translation keep a sphere a sphere, bake into world space
+			this->center = transformPoint(transform, center);
+			this->radius = radius * scale;
+			this->setTransform(glm::mat4(1.f));
+		}
+		else {
+			this->setTransform(transform);
+		}
+	};
+
+	// true if transform is affine and its linear part is a rotation times a uniform scale
+	bool isSimilarity(glm::mat4 transform, float &scale) {
+		if(!this->isAffine(transform)) {
+			return false;
+		}
+		glm::mat3 linear = glm::mat3(transform);
+		glm::mat3 gram = glm::transpose(linear) * linear;	// scale^2 * identity for similarities
+		const float scale2 = gram[0][0];
+		const float tolerance = 1e-5f * scale2;
+		for(int i = 0; i < 3; i++) {
+			for(int j = 0; j < 3; j++) {
+				if(glm::abs(gram[i][j] - (i == j ? scale2 : 0.f)) > tolerance) {
+					return false;
+				}
+			}
+		}
+		scale = glm::sqrt(scale2);
+		return scale > 0;
 	};
 
-	virtual HitInfo intersect(glm::vec3 O, glm::vec3 D) {
+	virtual void applyTransform(glm::mat4 transform) {
+		float scale;
+		if(!this->hasTransform && this->isSimilarity(transform, scale)) {
+			this->center = transformPoint(transform, this->center);
+			this->radius = this->radius * scale;
+		}
+		else {
+			this->setTransform(transform * this->transform);
+		}
+	};
+
+	virtual HitInfo intersect(glm::vec3 O, glm::vec3 D, int primID) {
 		float r = this->radius;
 		glm::vec3 S = this->center;
 		glm::vec3 Q = O - S;
@@ -231,7 +415,7 @@ public:
         if(discriminant == 0) {
             float t = -p/2;
 
-            return HitInfo(true, t, (O + t*D) - S, &this->material);
+            return HitInfo(true, t, (O + t*D) - S, this->materialIndex);
         }
         else if (discriminant > 0) {
             float root = glm::sqrt(discriminant);
@@ -244,73 +428,221 @@ public:
             if(x1 <= 0) t = x2;
             if(x2 <= 0) t = x1;
 
-            return HitInfo(true, t, (O + t*D) - S, &this->material);
+            return HitInfo(true, t, (O + t*D) - S, this->materialIndex);
         }
 
         return HitInfo();
 	};
 
-	virtual std::pair<glm::vec3, glm::vec3> getExtends() {
+	virtual bool occluded(glm::vec3 O, glm::vec3 D, int primID, float t_max) {
+		glm::vec3 Q = O - this->center;
+
+        float p = 2*glm::dot(Q, D) / glm::dot(D, D);
+        float q = (glm::dot(Q, Q) - this->radius*this->radius) / glm::dot(D, D);
+
+        float discriminant = p*p / 4 - q;
+        if(discriminant < 0) {
+        	return false;
+        }
+
+        // either intersection in range blocks the ray
+        float root = glm::sqrt(discriminant);
+        float x1 = -p/2 - root;
+        float x2 = -p/2 + root;
+        return (x1 > 0 && x1 < t_max) || (x2 > 0 && x2 < t_max);
+	};
+
+	virtual std::pair<glm::vec3, glm::vec3> getExtends(int primID) {
 		glm::vec3 diagonal = glm::vec3(this->radius,this->radius,this->radius);
 		glm::vec3 start = this->center - diagonal;
 		glm::vec3 end = this->center + diagonal;
 
 		return this->boundingBoxOfTransformedBoundingBox(start, end);
 	}
+
+	virtual bool getWorldSphere(int primID, glm::vec3 &center, float &radius) {
+		center = this->center;
+		radius = this->radius;
+		return !this->hasTransform;
+	};
 };
 
+// ray triangle intersection (Moeller-Trumbore) for triangle A, B, C shared by Triangle and TriangleMesh
+inline HitInfo intersectTriangle(glm::vec3 A, glm::vec3 B, glm::vec3 C, glm::vec3 origin, glm::vec3 rayDir, int materialIndex) {
+    // barycentric tolerance, closes cracks on shared edges of triangles baked into world space
+    const float edgeEpsilon = 1e-6f;
+    const glm::vec3 edge1 = B - A;
+    const glm::vec3 edge2 = C - A;
+
+    const glm::vec3 p = glm::cross(rayDir, edge2);
+    const float det = glm::dot(edge1, p);
+    if(det == 0) {
+        return HitInfo();	// ray parallel to triangle
+    }
+    const float invDet = 1.f / det;
+
+    const glm::vec3 s = origin - A;
+    const float u = glm::dot(s, p) * invDet;
+    const glm::vec3 q = glm::cross(s, edge1);
+    const float v = glm::dot(rayDir, q) * invDet;
+    const float t = glm::dot(edge2, q) * invDet;
+
+    if(u >= -edgeEpsilon && v >= -edgeEpsilon && u + v <= 1 + edgeEpsilon && t > 0) {
+        // normal gets normalized on transformation to world space
+        return HitInfo(true, t, glm::cross(edge1, edge2), materialIndex);
+    }
+    return HitInfo();
+}
+
 class Triangle : public ITransformedIntersectable {
+	friend class SceneCache;
 private:
 	glm::vec3 A, B, C;	// 3 vertices of a triangle
 
-	// rule of sarrus, gets the terms for the determinant of a 3x3 Matrix a, b, c are column vectors
-	inline float detTerm3x3(glm::vec3 a, glm::vec3 b, glm::vec3 c, int index) {
-		int index1 = index % 3;
-		int index2 = (index + 1) % 3;
-		int index3 = (index + 2) % 3;
-		return a[index1] * b[index2] * c[index3] - c[index1] * b[index2] * a[index3];
-	};
-
-	// return determinant for matrix (there is also glm::determinant)
-	inline float det3x3(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
-		float t1 = detTerm3x3(a, b, c, 0);
-		float t2 = detTerm3x3(a, b, c, 1);
-		float t3 = detTerm3x3(a, b, c, 2);
-		return t1 + t2 + t3;
-	};
-	/**
-	 * a, b, c = column vector 1, 2, 3 in Matrix A
-	 * d = Solution column vector
-	 * A = (a, b, c)
-	 * A * x = d
-	 * returns column vector x which Matrix A multiplied with has result d
-	 */
-	glm::vec3 solve3x3(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d) {
-		float detA = det3x3(a, b, c);
-		float x = det3x3(d, b, c) / detA;
-		float y = det3x3(a, d, c) / detA;
-		float z = det3x3(a, b, d) / detA;
-		return glm::vec3(x, y, z);
-	};
-
 public:
-	Triangle(glm::vec3 A, glm::vec3 B, glm::vec3 C, Material material, glm::mat4 transform)  {
-		this->transform = transform;
-		this->material = material;
+	Triangle(glm::vec3 A, glm::vec3 B, glm::vec3 C, int materialIndex, glm::mat4 transform)  {
+		this->materialIndex = materialIndex;
 		this->A = A;
 		this->B = B;
 		this->C = C;
+
+		if(this->isAffine(transform)) {
+			// bake into world space, triangles stay triangles under affine transforms
+			this->A = transformPoint(transform, A);
+			this->B = transformPoint(transform, B);
+			this->C = transformPoint(transform, C);
+			// mirroring transforms flip the winding, swap to keep the normal as transformed by the normal matrix
+			if(glm::determinant(glm::mat3(transform)) < 0) {
+				std::swap(this->B, this->C);
+			}
+			this->setTransform(glm::mat4(1.f));
+		}
+		else {
+			this->setTransform(transform);
+		}
 	};
 
-	virtual HitInfo intersect(glm::vec3 origin, glm::vec3 rayDir) {
-        glm::vec3 solution = solve3x3(A-B, A-C, rayDir, A-origin);
-        if(solution.x >= 0 && solution.y>=0 && solution.x + solution.y <= 1 && solution.z >0) {
-            return HitInfo(true, solution.z, glm::normalize(glm::cross(B-A, C-A)), &this->material);
-        }
-        return HitInfo();
+	virtual void applyTransform(glm::mat4 transform) {
+		if(!this->hasTransform && this->isAffine(transform)) {
+			this->A = transformPoint(transform, this->A);
+			this->B = transformPoint(transform, this->B);
+			this->C = transformPoint(transform, this->C);
+			if(glm::determinant(glm::mat3(transform)) < 0) {
+				std::swap(this->B, this->C);
+			}
+		}
+		else {
+			this->setTransform(transform * this->transform);
+		}
+	};
+
+	virtual HitInfo intersect(glm::vec3 origin, glm::vec3 rayDir, int primID) {
+		return intersectTriangle(A, B, C, origin, rayDir, this->materialIndex);
+	};
+
+	virtual bool getWorldTriangle(int primID, glm::vec3 &A, glm::vec3 &B, glm::vec3 &C) {
+		A = this->A;
+		B = this->B;
+		C = this->C;
+		return !this->hasTransform;
+	};
+
+	virtual std::pair<glm::vec3, glm::vec3> getExtends(int primID) {
+		auto start = glm::min(glm::min(A, B), C);
+		auto end = glm::max(glm::max(A, B), C);
+
+		return this->boundingBoxOfTransformedBoundingBox(start, end);
+	}
+};
+
+// Indexed triangles sharing one contiguous vertex buffer, material and transform.
+// Every triangle is a primitive addressed by its primID (index into indices).
+class TriangleMesh : public ITransformedIntersectable {
+	friend class SceneCache;
+private:
+	std::vector<glm::vec3> vertices;	// world space if the transform got baked, object space otherwise
+	std::vector<glm::ivec3> indices;	// 3 vertex indices per triangle
+
+	glm::mat4 sourceTransform;		// transform as given at construction
+	glm::mat4 bakeTransform;		// applied to vertices on insertion, identity if not baked
+	bool flipWinding = false;
+
+public:
+	TriangleMesh(int materialIndex, glm::mat4 transform) {
+		this->materialIndex = materialIndex;
+		this->sourceTransform = transform;
+
+		if(this->isAffine(transform)) {
+			// bake into world space like Triangle does, see there
+			this->bakeTransform = transform;
+			this->flipWinding = glm::determinant(glm::mat3(transform)) < 0;
+			this->setTransform(glm::mat4(1.f));
+		}
+		else {
+			this->bakeTransform = glm::mat4(1.f);
+			this->setTransform(transform);
+		}
+	};
+
+	// returns index of the new vertex
+	int addVertex(glm::vec3 vertex) {
+		this->vertices.push_back(transformPoint(this->bakeTransform, vertex));
+		return int(this->vertices.size()) - 1;
+	};
+
+	// returns primID of the new triangle
+	int addTriangle(int indexA, int indexB, int indexC) {
+		if(this->flipWinding) {
+			std::swap(indexB, indexC);
+		}
+		this->indices.push_back(glm::ivec3(indexA, indexB, indexC));
+		return int(this->indices.size()) - 1;
+	};
+
+	glm::mat4 getSourceTransform() {
+		return this->sourceTransform;
+	};
+
+	virtual void applyTransform(glm::mat4 transform) {
+		this->sourceTransform = transform * this->sourceTransform;
+		if(!this->hasTransform && this->isAffine(transform)) {
+			for(auto &vertex : this->vertices) {
+				vertex = transformPoint(transform, vertex);
+			}
+			if(glm::determinant(glm::mat3(transform)) < 0) {
+				for(auto &index : this->indices) {
+					std::swap(index.y, index.z);
+				}
+				this->flipWinding = !this->flipWinding;
+			}
+			this->bakeTransform = transform * this->bakeTransform;
+		}
+		else {
+			this->setTransform(transform * this->transform);
+		}
+	};
+
+	virtual int getPrimitiveCount() {
+		return int(this->indices.size());
+	};
+
+	virtual HitInfo intersect(glm::vec3 origin, glm::vec3 rayDir, int primID) {
+		const glm::ivec3 &index = this->indices[primID];
+		return intersectTriangle(this->vertices[index.x], this->vertices[index.y], this->vertices[index.z],
+				origin, rayDir, this->materialIndex);
+	};
+
+	virtual bool getWorldTriangle(int primID, glm::vec3 &A, glm::vec3 &B, glm::vec3 &C) {
+		const glm::ivec3 &index = this->indices[primID];
+		A = this->vertices[index.x];
+		B = this->vertices[index.y];
+		C = this->vertices[index.z];
+		return !this->hasTransform;
 	};
 
-	virtual std::pair<glm::vec3, glm::vec3> getExtends() {
+	virtual std::pair<glm::vec3, glm::vec3> getExtends(int primID) {
+		const glm::ivec3 &index = this->indices[primID];
+		glm::vec3 A = this->vertices[index.x], B = this->vertices[index.y], C = this->vertices[index.z];
 		auto start = glm::min(glm::min(A, B), C);
 		auto end = glm::max(glm::max(A, B), C);
 
@@ -318,6 +650,35 @@ public:
 	}
 };
 
+// primary rays of a pixel block sharing the camera origin, SoA with one lane per pixel
+struct RayPacket {
+	static const int maxSize = 64;	// 8x8 pixels
+
+	int size = 0;
+	glm::vec3 origin;
+	alignas(32) float dx[maxSize], dy[maxSize], dz[maxSize];
+	alignas(32) float invDx[maxSize], invDy[maxSize], invDz[maxSize];
+	int px[maxSize], py[maxSize];	// pixel of each ray
+
+	// direction gets normalized like in trace(), so packets hit exactly what single rays hit
+	void add(int x, int y, glm::vec3 direction) {
+		direction = glm::normalize(direction);
+		int lane = this->size++;
+		px[lane] = x;
+		py[lane] = y;
+		dx[lane] = direction.x;
+		dy[lane] = direction.y;
+		dz[lane] = direction.z;
+		invDx[lane] = 1.f / direction.x;
+		invDy[lane] = 1.f / direction.y;
+		invDz[lane] = 1.f / direction.z;
+	}
+
+	inline glm::vec3 getDirection(int lane) const {
+		return glm::vec3(dx[lane], dy[lane], dz[lane]);
+	}
+};
+
 struct Camera {
 	glm::vec3 eye;
 	glm::vec3 center;
@@ -326,8 +687,8 @@ struct Camera {
 
 	glm::vec3 u, v, w; // camera frame axes
 
-	int width;
-	int height;
+	int width = 0;
+	int height = 0;
 	// update/calculate camera frame axes
 	void updateAxes() {
 		glm::vec3 eyeDir = center - eye;
@@ -337,8 +698,11 @@ struct Camera {
 	};
 
 	glm::vec3 getRayAt(int x, int y) {
-		float j = (float) x + 0.5;
-		float i = (float) y + 0.5;
+		return this->getRayThrough((float) x + 0.5f, (float) y + 0.5f);
+	};
+
+	// ray through the point j, i of the image plane in pixel units, pixel x, y covers [x, x + 1) x [y, y + 1)
+	glm::vec3 getRayThrough(float j, float i) {
 		const float aspect = (float) width / (float) height;
 		const float tany = glm::tan(fovDeg * glm::pi<float>() / 360.f); //conv to rad and half fovy
 		const float tanx = tany * aspect;
@@ -349,6 +713,38 @@ struct Camera {
 		const float b = tany * ((halfH - i) / halfH);
 		return glm::normalize(a * u + b * v - w);
 	};
+
+	// rays for the block of blockSize x blockSize pixels starting at x0, y0, clipped to the image.
+	// Same directions as getRayAt, setup is done once per packet.
+	void getRayPacket(int x0, int y0, int blockSize, RayPacket &packet) {
+		const float aspect = (float) width / (float) height;
+		const float tany = glm::tan(fovDeg * glm::pi<float>() / 360.f); //conv to rad and half fovy
+		const float tanx = tany * aspect;
+		const float halfW = (float) width / 2.f;
+		const float halfH = (float) height / 2.f;
+
+		packet.size = 0;
+		packet.origin = eye;
+		for(int y = y0; y < std::min(y0 + blockSize, height); y++) {
+			const float i = (float) y + 0.5;
+			const float b = tany * ((halfH - i) / halfH);
+			for(int x = x0; x < std::min(x0 + blockSize, width); x++) {
+				const float j = (float) x + 0.5;
+				const float a = tanx * ((j - halfW) / halfW);
+				packet.add(x, y, glm::normalize(a * u + b * v - w));
+			}
+		}
+
+		// pad to full simd lanes with copies of the first ray, these lanes are never active
+		for(int lane = packet.size; lane < RayPacket::maxSize; lane++) {
+			packet.dx[lane] = packet.dx[0];
+			packet.dy[lane] = packet.dy[0];
+			packet.dz[lane] = packet.dz[0];
+			packet.invDx[lane] = packet.invDx[0];
+			packet.invDy[lane] = packet.invDy[0];
+			packet.invDz[lane] = packet.invDz[0];
+		}
+	};
 };
 
 enum LightType {
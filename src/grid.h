@@ -4,28 +4,71 @@
 #define SRC_GRID_H_
 
 #include "geometries.h"
+#include "container.h"
 #include "Image3f.h"
 
 #include<tuple>
+#include<vector>
+#include<cmath>
+#include<cstdint>
+#include<algorithm>
+#include<omp.h>
 
 class Grid : public IIntersectable {
+	// targeted number of cells per primitive, used to derive the resolution from the scene
+	const float cellsPerPrimitive = 2.0f;
+	const int maxResolution = 64;		// per axis, top level
+	const int maxSubResolution = 8;		// per axis, nested grids
+	const size_t maxCellPrimitives = 24; // cells above get subdivided into a nested grid
+	const int maxLevels = 2;
+	// updates give up once a cell that could be subdivided holds more than this many times maxCellPrimitives
+	const size_t rebuildCrowding = 2;
+	const size_t chunkPrimitives = 4096;	// builds split the primitives into chunks of at least this many per thread
+	// the top level grid reaches this fraction of the scene's largest extent beyond the scene, so updates
+	// moving primitives a little keep them in the cells
+	const float updateSlack = 0.01f;
+
 	glm::vec3 start_pos; // lowest bounds in aabb
 	glm::vec3 end_pos; 	 // highest bounds ind aabb
 	glm::vec3 size; 	 // w, h, d
 	glm::vec3 resolution;// grid resolution
+	glm::vec3 cellSize;	 // w, h, d of a single cell
+	int level;			 // 0 = top level grid
 
 	std::unique_ptr<Container[]> cells;		// cells of vectors
+	std::vector<std::uint64_t> occupancy;	// bit per cell, set if cell has geometry or a nested grid
+	std::vector<std::unique_ptr<Grid>> subgrids; // nested grid per crowded cell, empty if there are none
+	std::vector<int> dirtyCells;			// cells changed by an update that need packing
+	Container outside;						// primitives updates moved beyond the bounds, tested by every ray
 
 public:
 
-	std::pair<glm::vec3, glm::vec3 > getSceneBounds(std::vector<ITransformedIntersectable*> *geometries_ptr) {
-		// get bounds
+	// number of chunks the primitives get split into for parallel building, one per thread at most
+	int getChunkCount(size_t primitiveCount) {
+		return int(std::min<size_t>(primitiveCount / chunkPrimitives + 1, omp_get_max_threads()));
+	}
+
+	std::pair<glm::vec3, glm::vec3 > getSceneBounds(std::vector<PrimitiveRef> *primitives_ptr) {
+		const std::vector<PrimitiveRef> &primitives = *primitives_ptr;
+		const int chunkCount = this->getChunkCount(primitives.size());
+
+		// get bounds, per chunk and then of the chunks
+		std::vector<glm::vec3> chunk_start(chunkCount, glm::vec3(1, 1, 1) * FLOAT_MAX);
+		std::vector<glm::vec3> chunk_end(chunkCount, glm::vec3(1, 1, 1) * -FLOAT_MAX);
+		#pragma omp parallel for if(chunkCount > 1)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			for(size_t i = primitives.size() * chunk / chunkCount; i < primitives.size() * (chunk + 1) / chunkCount; i++) {
+				auto [start, end] = primitives[i].getExtends();
+				chunk_start[chunk] = glm::min(glm::min(chunk_start[chunk], start), end);
+				chunk_end[chunk] = glm::max(glm::max(chunk_end[chunk], end), start);
+			}
+		}
+
 		glm::vec3 min_start = glm::vec3(1, 1, 1) * FLOAT_MAX;
-		glm::vec3 max_end = glm::vec3(1, 1, 1) * FLOAT_MIN;
-		for(auto const& geometry_ptr : *geometries_ptr) {
-			auto [start, end] = geometry_ptr->getExtends();
-			min_start = glm::min(glm::min(min_start, start), end);
-			max_end = glm::max(glm::max(max_end, end), start);
+		glm::vec3 max_end = glm::vec3(1, 1, 1) * -FLOAT_MAX;
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			min_start = glm::min(min_start, chunk_start[chunk]);
+			max_end = glm::max(max_end, chunk_end[chunk]);
 		}
 
 		const float epsilon = 0.001;
@@ -33,22 +76,165 @@ public:
 		return std::pair<glm::vec3, glm::vec3> {min_start - epsilon_vec, max_end + epsilon_vec};
 	}
 
-	Grid(std::vector<ITransformedIntersectable*> *geometries_ptr) {		//glm::vec3 start_pos, glm::vec3 end_pos, glm::vec3 resolution)  {
-		glm::vec3 resolution = glm::vec3(1, 1, 1) * 15.0f;
-		auto [start, end] = this->getSceneBounds(geometries_ptr);
+	// picks cells per axis so that the grid has about cellsPerPrimitive * primitiveCount roughly cubic cells
+	glm::vec3 getResolution(glm::vec3 size, size_t primitiveCount, int maxAxisResolution) {
+		const float volume = size.x * size.y * size.z;
+		const float cellsPerUnit = std::cbrt(cellsPerPrimitive * float(primitiveCount) / volume);
+
+		glm::vec3 resolution;
+		for(int axis = 0; axis < 3; axis++) {
+			resolution[axis] = clamp(glm::floor(size[axis] * cellsPerUnit + 0.5f), 1, maxAxisResolution);
+		}
+		return resolution;
+	}
+
+	Grid(std::vector<ITransformedIntersectable*> *geometries_ptr) {
+		std::vector<PrimitiveRef> primitives = collectPrimitives(geometries_ptr);
+		auto [start, end] = this->getSceneBounds(&primitives);
+		const glm::vec3 extent = end - start;
+		const float slack = this->updateSlack * std::max({extent.x, extent.y, extent.z});
+		this->build(&primitives, start - glm::vec3(1, 1, 1) * slack, end + glm::vec3(1, 1, 1) * slack, 0);
+	}
+
+	// nested grid covering start, end. primitives get clipped to these bounds
+	Grid(std::vector<PrimitiveRef> *primitives_ptr, glm::vec3 start, glm::vec3 end, int level) {
+		this->build(primitives_ptr, start, end, level);
+	}
+
+	~Grid() { }
+
+	void build(std::vector<PrimitiveRef> *primitives_ptr, glm::vec3 start, glm::vec3 end, int level) {
 		this->start_pos = start;
 		this->end_pos = end;
 		this->size = end - start;
-		this->resolution = resolution;
+		this->level = level;
+		this->resolution = this->getResolution(this->size, primitives_ptr->size(), level == 0 ? maxResolution : maxSubResolution);
+		this->cellSize = this->size / this->resolution;
 
-		cells = std::make_unique<Container[]>(int(resolution.x) * int(resolution.y) * int(resolution.z));
+		const int cellCount = int(resolution.x) * int(resolution.y) * int(resolution.z);
+		cells = std::make_unique<Container[]>(cellCount);
+		occupancy.assign((cellCount + 63) / 64, 0);
 
-		for(auto const& geometry_ptr : *geometries_ptr) {
-            this->placeIntoGrid(geometry_ptr);
+		this->placeIntoGrid(*primitives_ptr);
+
+		if(level + 1 < maxLevels) {
+			this->subdivideCrowdedCells();
+		}
+
+		// nested grids are built inside the parallel loop of their parent and stay on its thread
+		#pragma omp parallel for schedule(dynamic, 64) if(level == 0)
+		for(int offset = 0; offset < cellCount; offset++) {
+			if(this->isOccupied(offset)) {
+				this->cells.get()[offset].pack();
+			}
 		}
 	}
 
-	~Grid() { }
+	// places all primitives into the cells they overlap, in their order. Every chunk of primitives counts
+	// its references per cell, a prefix sum over cells and chunks gives every chunk the positions it
+	// scatters its references to, so the cells get filled in parallel without locking
+	void placeIntoGrid(const std::vector<PrimitiveRef> &primitives) {
+		const int cellCount = int(resolution.x) * int(resolution.y) * int(resolution.z);
+		const int chunkCount = this->getChunkCount(primitives.size());
+
+		// cell index range per primitive
+		std::vector<std::array<int, 6>> ranges(primitives.size());
+		std::vector<std::vector<int>> chunkCounts(chunkCount, std::vector<int>(cellCount, 0));
+		#pragma omp parallel for if(chunkCount > 1)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			std::vector<int> &counts = chunkCounts[chunk];
+			for(size_t i = primitives.size() * chunk / chunkCount; i < primitives.size() * (chunk + 1) / chunkCount; i++) {
+				auto [start, end] = primitives[i].getExtends();
+				auto [ix_min, iy_min, iz_min] = this->getCellIndicesAtPosition(start);
+				auto [ix_max, iy_max, iz_max] = this->getCellIndicesAtPosition(end);
+				ranges[i] = {ix_min, iy_min, iz_min, ix_max, iy_max, iz_max};
+				this->forCellsInRange(ranges[i], [&](int offset) { counts[offset]++; });
+			}
+		}
+
+		// cellStarts[offset] is the first reference of a cell, chunk counts become the chunks' write positions
+		std::vector<int> cellStarts(cellCount + 1, 0);
+		for(int offset = 0; offset < cellCount; offset++) {
+			int references = 0;
+			for(int chunk = 0; chunk < chunkCount; chunk++) {
+				references += chunkCounts[chunk][offset];
+			}
+			cellStarts[offset + 1] = cellStarts[offset] + references;
+		}
+		#pragma omp parallel for if(chunkCount > 1)
+		for(int offset = 0; offset < cellCount; offset++) {
+			int position = cellStarts[offset];
+			for(int chunk = 0; chunk < chunkCount; chunk++) {
+				const int count = chunkCounts[chunk][offset];
+				chunkCounts[chunk][offset] = position;
+				position += count;
+			}
+		}
+
+		std::vector<PrimitiveRef> references(cellStarts[cellCount]);
+		#pragma omp parallel for if(chunkCount > 1)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			std::vector<int> &positions = chunkCounts[chunk];
+			for(size_t i = primitives.size() * chunk / chunkCount; i < primitives.size() * (chunk + 1) / chunkCount; i++) {
+				this->forCellsInRange(ranges[i], [&](int offset) { references[positions[offset]++] = primitives[i]; });
+			}
+		}
+
+		// a word of occupancy bits per iteration, so no two threads write the same word
+		#pragma omp parallel for if(chunkCount > 1)
+		for(int word = 0; word < int(this->occupancy.size()); word++) {
+			for(int offset = word * 64; offset < std::min(cellCount, word * 64 + 64); offset++) {
+				if(cellStarts[offset + 1] == cellStarts[offset]) {
+					continue;
+				}
+				this->cells.get()[offset].getPrimitives().assign(references.begin() + cellStarts[offset], references.begin() + cellStarts[offset + 1]);
+				this->occupancy[word] |= std::uint64_t(1) << (offset & 63);
+			}
+		}
+	}
+
+	// calls visit(offset) for the cells within the index range {x_min, y_min, z_min, x_max, y_max, z_max}
+	template<typename CellVisitor>
+	void forCellsInRange(const std::array<int, 6> &range, CellVisitor visit) {
+		for (int index_z = range[2]; index_z <= range[5]; index_z++) {
+			for (int index_y = range[1]; index_y <= range[4]; index_y++) {
+				for (int index_x = range[0]; index_x <= range[3]; index_x++) {
+					visit(this->getOffsetAtIndices(index_x, index_y, index_z));
+				}
+			}
+		}
+	}
+
+	// replaces every cell holding more than maxCellPrimitives with a nested grid over its bounds
+	void subdivideCrowdedCells() {
+		std::vector<int> crowded;
+		for (int index_z = 0; index_z < int(resolution.z); index_z++) {
+            for (int index_y = 0; index_y < int(resolution.y); index_y++) {
+                for (int index_x = 0; index_x < int(resolution.x); index_x++) {
+                	if(this->getCellAtIndices(index_x, index_y, index_z)->size() > maxCellPrimitives) {
+                		crowded.push_back(this->getOffsetAtIndices(index_x, index_y, index_z));
+                	}
+                }
+            }
+		}
+		if(crowded.empty()) {
+			return;
+		}
+
+		this->subgrids.resize(int(resolution.x) * int(resolution.y) * int(resolution.z));
+		#pragma omp parallel for schedule(dynamic)
+		for(size_t i = 0; i < crowded.size(); i++) {
+			const int offset = crowded[i];
+			const int index_x = offset % int(resolution.x);
+			const int index_y = offset / int(resolution.x) % int(resolution.y);
+			const int index_z = offset / (int(resolution.x) * int(resolution.y));
+			Container *cell = &this->cells.get()[offset];
+
+			glm::vec3 cell_start = start_pos + glm::vec3(index_x, index_y, index_z) * cellSize;
+			this->subgrids[offset] = std::make_unique<Grid>(&cell->getPrimitives(), cell_start, cell_start + cellSize, level + 1);
+			cell->clear();
+		}
+	}
 
 	inline std::tuple<int, int, int> getCellIndicesAtPosition(glm::vec3 position) {
 		int ix = clamp(glm::floor((position.x - start_pos.x) * resolution.x / size.x), 0, resolution.x - 1);
@@ -62,9 +248,25 @@ public:
 		return index_x + this->resolution.x * index_y + this->resolution.y * this->resolution.x * index_z;
 	};
 
-	void placeIntoCell(int index_x, int index_y, int index_z, ITransformedIntersectable *geometry_ptr) {
+	inline bool isOccupied(int offset) {
+		return (this->occupancy[offset >> 6] >> (offset & 63)) & 1;
+	};
+
+	void placeIntoCell(int index_x, int index_y, int index_z, PrimitiveRef primitive) {
 		auto offset = this->getOffsetAtIndices(index_x, index_y, index_z);
-		this->cells.get()[offset].add(geometry_ptr);
+		if(!this->subgrids.empty() && this->subgrids[offset]) {
+			// only happens on updates, the build places everything before subdividing
+			this->subgrids[offset]->placeIntoGrid(primitive);
+			this->dirtyCells.push_back(offset);
+			return;
+		}
+
+		Container &cell = this->cells.get()[offset];
+		if(cell.isPacked() || cell.size() == 0) {
+			this->dirtyCells.push_back(offset);
+		}
+		cell.add(primitive);
+		this->occupancy[offset >> 6] |= std::uint64_t(1) << (offset & 63);
 	};
 
 	Container* getCellAtIndices(int index_x, int index_y, int index_z) {
@@ -72,69 +274,95 @@ public:
 		return &this->cells.get()[offset];
 	};
 
-	// Places geometry into grid cells. Extends won't be changed and should already exist.
-	void placeIntoGrid(ITransformedIntersectable *geometry_ptr)  {
-		auto [start, end] = geometry_ptr->getExtends();
+	// Places primitive into grid cells. Extends won't be changed and should already exist.
+	void placeIntoGrid(PrimitiveRef primitive)  {
+		auto [start, end] = primitive.getExtends();
 		auto [ix_min, iy_min, iz_min] = this->getCellIndicesAtPosition(start);
 		auto [ix_max, iy_max, iz_max]= this->getCellIndicesAtPosition(end);
 
         for (int index_z = iz_min; index_z <= iz_max; index_z++) {
             for (int index_y = iy_min; index_y <= iy_max; index_y++) {
                 for (int index_x = ix_min; index_x <= ix_max; index_x++) {
-                    this->placeIntoCell(index_x, index_y, index_z, geometry_ptr);
+                    this->placeIntoCell(index_x, index_y, index_z, primitive);
                 }
             }
         }
 	};
 
-	// calculates intersection with grid bbox and returns cell strides for grid on rayDir for scalar t (dtx, dty, dtz)
-	std::tuple<bool, float, glm::vec3, glm::vec3> collidesWithBox(glm::vec3 rayOrigin, glm::vec3 rayDir) {
-		const float epsilon = 0.0001;
-		// t.._start and t.._end are ray intersections with bounding box planes (axis aligned)
-		// division by zero supposedly treated as inf, -inf (IEEE floating point spec)
-		float tx_start = (this->start_pos.x - rayOrigin.x) / rayDir.x;
-		float tx_end = (this->end_pos.x - rayOrigin.x) / rayDir.x;
-
-		float ty_start = (this->start_pos.y - rayOrigin.y) / rayDir.y;
-		float ty_end = (this->end_pos.y - rayOrigin.y) / rayDir.y;
-
-		float tz_start = (this->start_pos.z - rayOrigin.z) / rayDir.z;
-		float tz_end = (this->end_pos.z - rayOrigin.z) / rayDir.z;
-
-		// t.._min, t.._max are length sorted hit points in relation to ray scalar
-		// TODO: might be more performant to assign with cases rather than by default
-		float tx_min = tx_start;
-		float tx_max = tx_end;
-		if(rayDir.x < 0) {
-			tx_min = tx_end;
-			tx_max = tx_start;
+	// removes all primitives of geometry_ptr from the cells overlapping start, end
+	void eraseFromGrid(ITransformedIntersectable *geometry_ptr, glm::vec3 start, glm::vec3 end) {
+		auto [ix_min, iy_min, iz_min] = this->getCellIndicesAtPosition(start);
+		auto [ix_max, iy_max, iz_max] = this->getCellIndicesAtPosition(end);
+
+		for (int index_z = iz_min; index_z <= iz_max; index_z++) {
+			for (int index_y = iy_min; index_y <= iy_max; index_y++) {
+				for (int index_x = ix_min; index_x <= ix_max; index_x++) {
+					auto offset = this->getOffsetAtIndices(index_x, index_y, index_z);
+					if(!this->isOccupied(offset)) {
+						continue;
+					}
+					if(!this->subgrids.empty() && this->subgrids[offset]) {
+						this->subgrids[offset]->eraseFromGrid(geometry_ptr, start, end);
+						this->dirtyCells.push_back(offset);
+						continue;
+					}
+
+					Container &cell = this->cells.get()[offset];
+					const bool packed = cell.isPacked();
+					if(cell.erase(geometry_ptr) == 0) {
+						continue;
+					}
+					if(packed) {
+						this->dirtyCells.push_back(offset);
+					}
+					if(cell.size() == 0) {
+						this->occupancy[offset >> 6] &= ~(std::uint64_t(1) << (offset & 63));
+					}
+				}
+			}
 		}
+	};
 
-		float ty_min = ty_start;
-		float ty_max = ty_end;
-		if(rayDir.y < 0) {
-			ty_min = ty_end;
-			ty_max = ty_start;
+	// packs the cells changed since the last call, false if one of them (or the primitives outside the
+	// bounds) got crowded enough to be subdivided
+	bool packDirtyCells() {
+		bool balanced = this->outside.size() <= rebuildCrowding * maxCellPrimitives;
+		if(!this->outside.isPacked()) {
+			this->outside.pack();
 		}
-
-		float tz_min = tz_start;
-		float tz_max = tz_end;
-		if(rayDir.z < 0) {
-			tz_min = tz_end;
-			tz_max = tz_start;
+		for(int offset : this->dirtyCells) {
+			if(!this->subgrids.empty() && this->subgrids[offset]) {
+				balanced &= this->subgrids[offset]->packDirtyCells();
+				continue;
+			}
+			Container &cell = this->cells.get()[offset];
+			if(level + 1 < maxLevels && cell.size() > rebuildCrowding * maxCellPrimitives) {
+				balanced = false;
+			}
+			if(!cell.isPacked()) {
+				cell.pack();
+			}
 		}
+		this->dirtyCells.clear();
+		return balanced;
+	};
 
-		// t0, t1 interval of interesections on ray
-		float t0 = std::max({tx_min, ty_min, tz_min});
-		float t1 = std::min({tx_max, ty_max, tz_max});
+	// calculates intersection with grid bbox, returns whether the box is hit and the interval t_enter, t_exit
+	std::tuple<bool, float, float> collidesWithBox(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit) {
+		// t.._start and t.._end are ray intersections with bounding box planes (axis aligned)
+		// division by zero supposedly treated as inf, -inf (IEEE floating point spec)
+		glm::vec3 t_start = (this->start_pos - rayOrigin) / rayDir;
+		glm::vec3 t_end = (this->end_pos - rayOrigin) / rayDir;
 
-		// TODO: convenience calcs and returns
-		glm::vec3 delta_t = glm::vec3 ( (tx_max - tx_min) / this->resolution.x,
-										(ty_max - ty_min) / this->resolution.y,
-										(tz_max - tz_min) / this->resolution.z);
-		glm::vec3 t_min = glm::vec3(tx_min, ty_min, tz_min);
+		// t_near, t_far are length sorted hit points in relation to ray scalar
+		glm::vec3 t_near = glm::min(t_start, t_end);
+		glm::vec3 t_far = glm::max(t_start, t_end);
 
-		return {t0 < t1 && t1 > epsilon, t0, t_min, delta_t};
+		// t0, t1 interval of interesections on ray
+		float t0 = std::max({t_near.x, t_near.y, t_near.z, 0.f});
+		float t1 = std::min({t_far.x, t_far.y, t_far.z, t_limit});
+
+		return {t0 <= t1, t0, t1};
 	};
 
 	bool isInsideGrid(glm::vec3 position) {
@@ -146,123 +374,163 @@ public:
 		return false;
 	}
 
-	FragmentInfo traverseGrid(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit) {
-		auto [ isHit, t, t_mins, dt ] = this->collidesWithBox(rayOrigin, rayDir);
+	// 3D-DDA through the grid, calls visitCell(offset, t_cell_exit) for every cell the ray passes within
+	// (0, t_limit) in front to back order. Stops and returns true as soon as visitCell returns true.
+	template<typename CellVisitor>
+	bool marchCells(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit, CellVisitor visitCell) {
+		auto [ isHit, t_enter, t_exit ] = this->collidesWithBox(rayOrigin, rayDir, t_limit);
 
 		if(!isHit) {
-			return FragmentInfo();
-		}
-
-		glm::vec3 position;
-		if(this->isInsideGrid(rayOrigin)) {
-			position = rayOrigin;
-		}
-		else {
-			position = rayOrigin + t * rayDir;
+			return false;
 		}
 
+		glm::vec3 position = this->isInsideGrid(rayOrigin) ? rayOrigin : rayOrigin + t_enter * rayDir;
 		auto [ index_x, index_y, index_z ] = this->getCellIndicesAtPosition(position);
-
-		int ix_step;
-		int ix_stop;
-		float tx_next;
-		if(rayDir.x > 0) {
-            ix_step = 1;
-            ix_stop = int(this->resolution.x);
-            int next_ix = index_x + 1;
-            tx_next = t_mins.x + next_ix * dt.x;
-		}
-		else if (rayDir.x < 0) {
-            ix_step = -1;
-            ix_stop = -1;
-            int next_ix = int(this->resolution.x) - index_x;
-            tx_next = t_mins.x + next_ix * dt.x;
-		}
-		else {
-            ix_step = -1;
-            ix_stop = -1;
-            tx_next = FLOAT_MAX;
-		}
-
-		int iy_step;
-		int iy_stop;
-		float ty_next;
-		if(rayDir.y > 0) {
-            iy_step = 1;
-            iy_stop = int(this->resolution.y);
-            int next_iy = index_y + 1;
-            ty_next = t_mins.y + next_iy * dt.y;
-		}
-		else if (rayDir.y < 0) {
-            iy_step = -1;
-            iy_stop = -1;
-            int next_iy = int(this->resolution.y) - index_y;
-            ty_next = t_mins.y + next_iy * dt.y;
-		}
-		else {
-            iy_step = -1;
-            iy_stop = -1;
-            ty_next = FLOAT_MAX;
-		}
-
-		int iz_step;
-		int iz_stop;
-		float tz_next;
-		if(rayDir.z > 0) {
-            iz_step = 1;
-            iz_stop = int(this->resolution.z);
-            int next_iz = index_z + 1;
-            tz_next = t_mins.z + next_iz * dt.z;
-		}
-		else if (rayDir.z < 0) {
-            iz_step = -1;
-            iz_stop = -1;
-            int next_iz = int(this->resolution.z) - index_z;
-            tz_next = t_mins.z + next_iz * dt.z;
-		}
-		else {
-            iz_step = -1;
-            iz_stop = -1;
-            tz_next = FLOAT_MAX;
+		int index[3] = { index_x, index_y, index_z };
+
+		int step[3];
+		int stop[3];
+		float t_next[3];	// t at which the ray crosses into the next cell on this axis
+		float dt[3];		// t covered by one cell on this axis
+		for(int axis = 0; axis < 3; axis++) {
+			if(rayDir[axis] > 0) {
+				step[axis] = 1;
+				stop[axis] = int(this->resolution[axis]);
+				t_next[axis] = (start_pos[axis] + (index[axis] + 1) * cellSize[axis] - rayOrigin[axis]) / rayDir[axis];
+				dt[axis] = cellSize[axis] / rayDir[axis];
+			}
+			else if(rayDir[axis] < 0) {
+				step[axis] = -1;
+				stop[axis] = -1;
+				t_next[axis] = (start_pos[axis] + index[axis] * cellSize[axis] - rayOrigin[axis]) / rayDir[axis];
+				dt[axis] = -cellSize[axis] / rayDir[axis];
+			}
+			else {
+				step[axis] = 0;
+				stop[axis] = -1;
+				t_next[axis] = FLOAT_MAX;
+				dt[axis] = 0;
+			}
 		}
 
-		while(index_x != ix_stop && index_y != iy_stop && index_z != iz_stop) {
-			float t_next_min = std::min({tx_next, ty_next, tz_next, t_limit}); // readability/convenience
+		while(true) {
+			const int offset = this->getOffsetAtIndices(index[0], index[1], index[2]);
 
-			Container *cell = this->getCellAtIndices(index_x, index_y, index_z);
-			FragmentInfo fragmentInfo = cell->intersect(rayOrigin, rayDir, t_next_min);
+			// next axis boundary to cross
+			int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			const float t_cell_exit = t_next[axis];
 
-			if(fragmentInfo.validHit) {
-				return fragmentInfo;
+			COUNT_STATISTIC(STAT_CELLS_VISITED, 1);
+			if(visitCell(offset, t_cell_exit)) {
+				return true;
+			}
+			if(t_cell_exit >= t_exit) {
+				return false;
 			}
 
-			if(t_next_min == tx_next) {
-				index_x += ix_step;
-				tx_next += dt.x;
+			index[axis] += step[axis];
+			if(index[axis] == stop[axis]) {
+				return false;
 			}
-			else if(t_next_min == ty_next) {
-				index_y += iy_step;
-				ty_next += dt.y;
+			t_next[axis] += dt[axis];
+		}
+	}
+
+	// closest hit traversal. The closest hit found so far is kept in min_hitInfo/min_geometry_ptr, hits may
+	// lie behind the current cell, their primitive is mailboxed and won't be tested again in later cells.
+	// Traversal stops as soon as the closest hit lies within the cells visited already.
+	void traverseGrid(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit,
+			HitInfo &min_hitInfo, ITransformedIntersectable *&min_geometry_ptr, Mailbox &mailbox) {
+		this->marchCells(rayOrigin, rayDir, t_limit, [&](int offset, float t_cell_exit) {
+			if(this->isOccupied(offset)) {
+				if(!this->subgrids.empty() && this->subgrids[offset]) {
+					this->subgrids[offset]->traverseGrid(rayOrigin, rayDir, t_limit, min_hitInfo, min_geometry_ptr, mailbox);
+				}
+				else {
+					this->cells.get()[offset].intersectClosest(rayOrigin, rayDir, t_limit, min_hitInfo, min_geometry_ptr, &mailbox);
+				}
 			}
-			else if(t_next_min == tz_next) {
-				index_z += iz_step;
-				tz_next += dt.z;
+			return min_hitInfo.t <= t_cell_exit;
+		});
+	}
+
+	// any hit traversal, every hit within (0, t_limit) blocks the ray no matter which cell it lies in
+	bool traverseGridAny(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit, PrimitiveRef *occluder, Mailbox &mailbox) {
+		return this->marchCells(rayOrigin, rayDir, t_limit, [&](int offset, float t_cell_exit) {
+			if(!this->isOccupied(offset)) {
+				return false;
 			}
-			else if(t_next_min == t_limit) {
-				return FragmentInfo();
+			if(!this->subgrids.empty() && this->subgrids[offset]) {
+				return this->subgrids[offset]->traverseGridAny(rayOrigin, rayDir, t_limit, occluder, mailbox);
 			}
-		}
+			return this->cells.get()[offset].intersectAny(rayOrigin, rayDir, t_limit, occluder, &mailbox);
+		});
+	}
+
+	FragmentInfo traverseGrid(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit) {
+		HitInfo min_hitInfo;
+		ITransformedIntersectable *min_geometry_ptr = nullptr;
+		Mailbox mailbox;
+
+		this->traverseGrid(rayOrigin, rayDir, t_limit, min_hitInfo, min_geometry_ptr, mailbox);
 
-		return FragmentInfo();
+		return toFragmentInfo(rayOrigin, rayDir, min_hitInfo, min_geometry_ptr);
 	}
 
 	virtual FragmentInfo intersect(glm::vec3 O, glm::vec3 D, float t_limit = FLT_MAX) {
-		return this->traverseGrid(O, D, t_limit);
+		FragmentInfo fragmentInfo = this->traverseGrid(O, D, t_limit);
+		if(this->outside.size() > 0) {
+			FragmentInfo outsideInfo = this->outside.intersect(O, D, fragmentInfo.validHit ? fragmentInfo.t : t_limit);
+			if(outsideInfo.validHit) {
+				return outsideInfo;
+			}
+		}
+		return fragmentInfo;
+	};
+
+	virtual bool occluded(glm::vec3 O, glm::vec3 D, float t_max = FLT_MAX, PrimitiveRef *occluder = nullptr) {
+		Mailbox mailbox;
+		return this->traverseGridAny(O, D, t_max, occluder, mailbox)
+				|| (this->outside.size() > 0 && this->outside.occluded(O, D, t_max, occluder));
 	};
 
 	virtual std::pair<glm::vec3, glm::vec3> getExtends() {
 		return {this->start_pos, this->end_pos};
 	};
+
+	// re-buckets the changed geometries: their primitives get erased from the cells of their old bounds
+	// and placed anew. Primitives beyond the grid bounds are kept in a list every ray tests, only crowded
+	// cells or too many primitives outside need a rebuild
+	virtual bool update(const SceneUpdate &update) {
+		for(auto const& change : update.moved) {
+			this->eraseFromGrid(change.geometry_ptr, change.bounds_min, change.bounds_max);
+			this->outside.erase(change.geometry_ptr);
+		}
+		for(auto const& change : update.removed) {
+			this->eraseFromGrid(change.geometry_ptr, change.bounds_min, change.bounds_max);
+			this->outside.erase(change.geometry_ptr);
+		}
+
+		auto place = [&](ITransformedIntersectable *geometry_ptr) {
+			for(int primID = 0; primID < geometry_ptr->getPrimitiveCount(); primID++) {
+				auto [start, end] = geometry_ptr->getExtends(primID);
+				if(glm::min(start, this->start_pos) == this->start_pos && glm::max(end, this->end_pos) == this->end_pos) {
+					this->placeIntoGrid({geometry_ptr, primID});
+				}
+				else {
+					this->outside.add({geometry_ptr, primID});
+				}
+			}
+		};
+		for(auto const& change : update.moved) {
+			place(change.geometry_ptr);
+		}
+		for(auto const& geometry_ptr : update.added) {
+			place(geometry_ptr);
+		}
+
+		return this->packDirtyCells();
+	};
 };
 
 
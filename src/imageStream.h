@@ -0,0 +1,100 @@
+/*
+ * imageStream.h
+ *
+ *  Writes finished tiles straight into a ppm or pfm file, so no full framebuffer is needed.
+ */
+
+#ifndef SRC_IMAGESTREAM_H_
+#define SRC_IMAGESTREAM_H_
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Image3f.h"
+
+// The file is created with its final size up front and every tile is written to its rows' offsets,
+// in whatever order the tiles finish. Same formats as Image3f::write3fPpm and Image3f::write3fPfm.
+class ImageStreamWriter {
+	std::ofstream file;
+	std::mutex fileLock;
+	int width, height;
+	bool pfm;
+	std::streamoff dataOffset = 0;
+	size_t pixelSize;	// bytes per pixel in the file
+
+public:
+	static bool supports(const std::string &filename) {
+		return Image3f::hasExtension(filename, ".ppm") || Image3f::hasExtension(filename, ".pfm");
+	}
+
+	ImageStreamWriter(const std::string &filename, int width, int height) : width(width), height(height) {
+		this->pfm = Image3f::hasExtension(filename, ".pfm");
+		this->pixelSize = this->pfm ? 3 * sizeof(float) : 3;
+
+		std::ostringstream header;
+		if(this->pfm) {
+			Image3f::writePfmHeader(header, width, height);
+		}
+		else {
+			Image3f::writePpmHeader(header, width, height);
+		}
+		const std::string headerBytes = header.str();
+		this->dataOffset = std::streamoff(headerBytes.size());
+
+		this->file.open(filename, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		this->file.write(headerBytes.data(), headerBytes.size());
+
+		// extend the file to its final size, untouched ranges stay holes until their tile arrives
+		const std::streamoff fileSize = this->dataOffset + std::streamoff(size_t(width) * height * this->pixelSize);
+		if(fileSize > this->dataOffset) {
+			this->file.seekp(fileSize - 1);
+			this->file.put('\0');
+		}
+	};
+
+	bool isOpen() const {
+		return this->file.is_open() && this->file.good();
+	};
+
+	// writes the pixels [x0, x1) x [y0, y1) of tile, which is addressed in frame coordinates
+	void writeTile(Image3f &tile, int x0, int y0, int x1, int y1) {
+		const int tileWidth = x1 - x0;
+		std::vector<unsigned char> rows(size_t(tileWidth) * (y1 - y0) * this->pixelSize);
+
+		// convert outside the lock, only the writes are serialized
+		for(int y = y0; y < y1; y++) {
+			unsigned char *row = rows.data() + size_t(y - y0) * tileWidth * this->pixelSize;
+			if(this->pfm) {
+				tile.rowTo3f(y, x0, x1, reinterpret_cast<float*>(row));
+			}
+			else {
+				for(int x = x0; x < x1; x++) {
+					glm::vec3 color = tile.getAt(x, y);
+					row[(x - x0) * 3]     = (unsigned char) (clamp(color[0]) * 255);
+					row[(x - x0) * 3 + 1] = (unsigned char) (clamp(color[1]) * 255);
+					row[(x - x0) * 3 + 2] = (unsigned char) (clamp(color[2]) * 255);
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> guard(this->fileLock);
+		for(int y = y0; y < y1; y++) {
+			const int fileRow = this->pfm ? this->height - 1 - y : y;
+			this->file.seekp(this->dataOffset + std::streamoff((size_t(fileRow) * this->width + x0) * this->pixelSize));
+			this->file.write(reinterpret_cast<const char*>(rows.data() + size_t(y - y0) * tileWidth * this->pixelSize),
+							 tileWidth * this->pixelSize);
+		}
+	};
+
+	// flushes the file, false if any write failed
+	bool close() {
+		this->file.close();
+		return !this->file.fail();
+	};
+};
+
+#endif /* SRC_IMAGESTREAM_H_ */
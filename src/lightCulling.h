@@ -0,0 +1,185 @@
+/*
+ * lightCulling.h
+ *
+ *  Selects the lights that can matter for a fragment, so shading stops scaling with the light count
+ *  of scenes with many attenuated lights.
+ */
+
+#ifndef SRC_LIGHTCULLING_H_
+#define SRC_LIGHTCULLING_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "geometries.h"
+
+// Every point light with distance falloff gets an influence radius, beyond which it adds at most threshold
+// to any channel of any material. These lights are bucketed into a uniform grid by their influence sphere,
+// a fragment only looks at the lights of its cell. Directional lights and lights without falloff reach
+// everything. The lights of a fragment are visited in index order, like without culling.
+class LightCuller {
+	static constexpr int maxCellsPerAxis = 64;
+
+	float threshold = 0;
+	std::vector<int> globalLights;			// relevant everywhere
+	std::vector<glm::vec3> centers;			// per light, influence sphere of the bounded ones
+	std::vector<float> squaredRadii;
+
+	glm::vec3 gridMin = glm::vec3(0, 0, 0);
+	float cellSize = 1;
+	int cellCounts[3] = { 0, 0, 0 };
+	std::vector<int> cellOffsets;			// lights of cell c are cellLights[cellOffsets[c], cellOffsets[c + 1])
+	std::vector<int> cellLights;
+
+	// distance at which c0 + c1 d + c2 d^2 reaches maxAttenuation, infinite without falloff
+	static float influenceRadius(glm::vec3 attenuation, float maxAttenuation) {
+		const float c0 = attenuation[0], c1 = attenuation[1], c2 = attenuation[2];
+		if(maxAttenuation <= c0) {
+			return 0;
+		}
+		if(c2 > 0) {
+			return (-c1 + std::sqrt(c1 * c1 + 4 * c2 * (maxAttenuation - c0))) / (2 * c2);
+		}
+		if(c1 > 0) {
+			return (maxAttenuation - c0) / c1;
+		}
+		return INFINITY;
+	}
+
+	int cellCoordinate(float coordinate, int axis) const {
+		return std::clamp(int((coordinate - this->gridMin[axis]) / this->cellSize), 0, this->cellCounts[axis] - 1);
+	}
+
+	template<typename Visit>
+	void forCellsOfLight(int light, Visit visit) const {
+		const float radius = std::sqrt(this->squaredRadii[light]);
+		int first[3], last[3];
+		for(int axis = 0; axis < 3; axis++) {
+			first[axis] = this->cellCoordinate(this->centers[light][axis] - radius, axis);
+			last[axis] = this->cellCoordinate(this->centers[light][axis] + radius, axis);
+		}
+		for(int z = first[2]; z <= last[2]; z++) {
+			for(int y = first[1]; y <= last[1]; y++) {
+				for(int x = first[0]; x <= last[0]; x++) {
+					visit((z * this->cellCounts[1] + y) * this->cellCounts[0] + x);
+				}
+			}
+		}
+	}
+
+public:
+	// threshold is the largest contribution per channel that gets skipped, 0 turns culling off
+	void build(const std::vector<Light> &lights, const std::vector<Material> &materials, float threshold) {
+		this->threshold = threshold;
+		this->globalLights.clear();
+		this->centers.assign(lights.size(), glm::vec3(0, 0, 0));
+		this->squaredRadii.assign(lights.size(), 0);
+		this->cellOffsets.clear();
+		this->cellLights.clear();
+
+		// calc_lighting is at most (diffuse + specular) * light color per channel
+		float materialBound = 0;
+		for(auto const& material : materials) {
+			for(int channel = 0; channel < 3; channel++) {
+				materialBound = std::max(materialBound, material.diffuseColor[channel] + material.specularColor[channel]);
+			}
+		}
+
+		std::vector<int> boundedLights;
+		glm::vec3 boundsMin(INFINITY, INFINITY, INFINITY), boundsMax(-INFINITY, -INFINITY, -INFINITY);
+		float radiusSum = 0;
+		for(int light = 0; light < int(lights.size()); light++) {
+			const float maxContribution = materialBound * std::max(lights[light].color[0],
+					std::max(lights[light].color[1], lights[light].color[2]));
+			const float radius = lights[light].type == LightType::POINT && threshold > 0
+					? influenceRadius(lights[light].attenuation, maxContribution / threshold) : INFINITY;
+			if(radius == INFINITY) {
+				this->globalLights.push_back(light);
+				continue;
+			}
+			if(radius <= 0) {
+				continue;	// never adds more than threshold
+			}
+			this->centers[light] = lights[light].position;
+			this->squaredRadii[light] = radius * radius;
+			boundedLights.push_back(light);
+			boundsMin = glm::min(boundsMin, lights[light].position - glm::vec3(radius, radius, radius));
+			boundsMax = glm::max(boundsMax, lights[light].position + glm::vec3(radius, radius, radius));
+			radiusSum += radius;
+		}
+		if(boundedLights.empty()) {
+			this->cellCounts[0] = this->cellCounts[1] = this->cellCounts[2] = 0;
+			return;
+		}
+
+		// cells about as big as an influence sphere, so a light lands in a few cells only
+		const glm::vec3 extent = boundsMax - boundsMin;
+		const float largestExtent = std::max(extent[0], std::max(extent[1], extent[2]));
+		this->gridMin = boundsMin;
+		this->cellSize = std::max(radiusSum / boundedLights.size(), largestExtent / maxCellsPerAxis);
+		for(int axis = 0; axis < 3; axis++) {
+			this->cellCounts[axis] = std::clamp(int(std::ceil(extent[axis] / this->cellSize)), 1, maxCellsPerAxis);
+		}
+
+		const int cellCount = this->cellCounts[0] * this->cellCounts[1] * this->cellCounts[2];
+		this->cellOffsets.assign(cellCount + 1, 0);
+		for(int light : boundedLights) {
+			this->forCellsOfLight(light, [&](int cell) {
+				this->cellOffsets[cell + 1]++;
+			});
+		}
+		for(int cell = 0; cell < cellCount; cell++) {
+			this->cellOffsets[cell + 1] += this->cellOffsets[cell];
+		}
+		this->cellLights.resize(this->cellOffsets[cellCount]);
+		std::vector<int> fill(this->cellOffsets.begin(), this->cellOffsets.end() - 1);
+		for(int light : boundedLights) {
+			this->forCellsOfLight(light, [&](int cell) {
+				this->cellLights[fill[cell]++] = light;
+			});
+		}
+	}
+
+	// false if a light adding at most contributionBound to a fragment can be skipped before its shadow ray is traced
+	bool matters(glm::vec3 contributionBound) const {
+		return this->threshold <= 0
+				|| glm::max(contributionBound[0], glm::max(contributionBound[1], contributionBound[2])) > this->threshold;
+	}
+
+	// calls visit(lightIndex) in ascending order for every light whose influence reaches position
+	template<typename Visit>
+	void forRelevantLights(glm::vec3 position, Visit visit) const {
+		const int *cellBegin = nullptr, *cellEnd = nullptr;
+		if(!this->cellOffsets.empty()) {
+			bool inside = true;
+			int cell = 0;
+			for(int axis = 2; axis >= 0; axis--) {
+				const float coordinate = (position[axis] - this->gridMin[axis]) / this->cellSize;
+				inside = inside && coordinate >= 0 && coordinate < this->cellCounts[axis];
+				cell = cell * this->cellCounts[axis] + std::clamp(int(coordinate), 0, this->cellCounts[axis] - 1);
+			}
+			if(inside) {
+				cellBegin = this->cellLights.data() + this->cellOffsets[cell];
+				cellEnd = this->cellLights.data() + this->cellOffsets[cell + 1];
+			}
+		}
+
+		auto global = this->globalLights.begin();
+		while(global != this->globalLights.end() || cellBegin != cellEnd) {
+			if(cellBegin == cellEnd || (global != this->globalLights.end() && *global < *cellBegin)) {
+				visit(*global++);
+				continue;
+			}
+			const int light = *cellBegin++;
+			const glm::vec3 offset = position - this->centers[light];
+			if(glm::dot(offset, offset) <= this->squaredRadii[light]) {
+				visit(light);
+			}
+		}
+	}
+};
+
+#endif /* SRC_LIGHTCULLING_H_ */
@@ -0,0 +1,81 @@
+/*
+ * lighting.h
+ *
+ *  Local illumination of a fragment by a single light.
+ */
+
+#ifndef SRC_LIGHTING_H_
+#define SRC_LIGHTING_H_
+
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "Image3f.h"
+#include "geometries.h"
+
+inline glm::vec3 calc_lighting(glm::vec3 rayDir, glm::vec3 shadowray_direction, glm::vec3 fragmentNormal,
+		const Material *material, glm::vec3 lightColor) {
+    // lambert shading
+    const float lambertShade = clamp(glm::dot(glm::normalize(shadowray_direction), fragmentNormal));
+
+    glm::vec3 lambert = material->diffuseColor * lightColor * lambertShade;
+    // phong shading
+    glm::vec3 halfvec = glm::normalize(glm::normalize(shadowray_direction) + glm::normalize(-rayDir));
+
+    const float phongShade = clamp(glm::dot(halfvec, fragmentNormal));
+
+    const float shinePow = glm::pow(std::max(phongShade, 0.f), material->shininess);
+    glm::vec3 phong = material->specularColor * lightColor * shinePow;
+
+    return lambert + phong;
+}
+
+// ray from a fragment towards a light, t_max is the distance to point lights
+struct ShadowRay {
+	glm::vec3 origin;
+	glm::vec3 direction;
+	float t_max;
+};
+
+inline ShadowRay shadowRayTowards(const Light &light, glm::vec3 position, float epsilonBias) {
+	ShadowRay ray;
+	if(light.type == LightType::POINT) {
+		ray.direction = glm::normalize(light.position - position);
+		ray.t_max = glm::dot(light.position - position, ray.direction);	// is distance on normalized ray, avoids square root
+	}
+	else {
+		ray.direction = glm::normalize(light.position);
+		ray.t_max = FLT_MAX;
+	}
+	ray.origin = position + epsilonBias * ray.direction;
+	return ray;
+}
+
+// light reaching a fragment along an unblocked shadow ray, point lights are attenuated by distance
+inline glm::vec3 lightContribution(const Light &light, const ShadowRay &ray, glm::vec3 rayDir, glm::vec3 fragmentNormal,
+		const Material *material) {
+	glm::vec3 color = calc_lighting(rayDir, ray.direction, fragmentNormal, material, light.color);
+	if(light.type == LightType::POINT) {
+		float attenuation = light.attenuation[0]
+					+ light.attenuation[1] * ray.t_max
+					+ light.attenuation[2] * ray.t_max * ray.t_max;
+		color /= attenuation;
+	}
+	return color;
+}
+
+// upper bound of lightContribution() per channel that needs no normalization or power, the phong lobe
+// is bounded by the specular color
+inline glm::vec3 contributionBound(const Light &light, const ShadowRay &ray, glm::vec3 fragmentNormal, const Material *material) {
+	const float lambertShade = clamp(glm::dot(ray.direction, fragmentNormal));
+	glm::vec3 bound = (material->diffuseColor * lambertShade + material->specularColor) * light.color;
+	if(light.type == LightType::POINT) {
+		bound /= light.attenuation[0]
+					+ light.attenuation[1] * ray.t_max
+					+ light.attenuation[2] * ray.t_max * ray.t_max;
+	}
+	return bound;
+}
+
+#endif /* SRC_LIGHTING_H_ */
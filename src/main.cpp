@@ -9,10 +9,15 @@
 #include <string>
 #include <fstream>
 #include <cstdio>
+#include <cstdlib>
 #include <limits>
 #include <omp.h>
 #include <cstddef>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <future>
+#include <vector>
 
 #include "Image3f.h"
 
@@ -20,144 +25,820 @@
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
-#include <opencv2/highgui.hpp>
 
 #include "readScene.h"
+#include "scheduler.h"
+#include "sceneCache.h"
+#include "lighting.h"
+#include "statistics.h"
+#include "imageStream.h"
+#include "distributed.h"
+#include "wavefront.h"
+#include "antialiasing.h"
 
 using namespace std;
 using namespace glm;
 
-inline glm::vec3 calc_lighting(glm::vec3 rayDir, glm::vec3 shadowray_direction, glm::vec3 fragmentNormal,
-		Material *material, glm::vec3 lightColor) {
-    // lambert shading
-    const float lambertShade = clamp(glm::dot(glm::normalize(shadowray_direction), fragmentNormal));
+glm::vec3 shadowRayTest(FragmentInfo fragmentInfo, glm::vec3 rayDir, SceneReader &sr) {
+	glm::vec3 shadowColor(0, 0, 0);
+	const Material *material = &sr.materials[fragmentInfo.materialIndex];
+	OccluderCache &occluderCache = sr.occluderCaches[omp_get_thread_num()];
+
+	sr.lightCuller.forRelevantLights(fragmentInfo.position, [&](int lightIndex) {
+		const Light &light = sr.lights[lightIndex];
+		const ShadowRay shadowRay = shadowRayTowards(light, fragmentInfo.position, sr.epsilonBias);
+		// lights that can't add enough even unoccluded aren't worth a shadow ray
+		if(!sr.lightCuller.matters(contributionBound(light, shadowRay, fragmentInfo.normal, material))) {
+			return;
+		}
+		COUNT_STATISTIC(STAT_SHADOW_RAYS, 1);
+		if(!occluderCache.occluded(sr.scene_content.get(), lightIndex, shadowRay.origin, shadowRay.direction, shadowRay.t_max)) {
+			shadowColor += lightContribution(light, shadowRay, rayDir, fragmentInfo.normal, material);
+		}
+	});
+
+	return clampRGB(shadowColor);
+}
+
+// color of a fragment hit by rayDir, including shadows and the reflection path of up to sr.maxDepth bounces.
+// The path is followed iteratively and ends early once its specular throughput drops to sr.minThroughput
+glm::vec3 shade(FragmentInfo fragmentInfo, glm::vec3 rayDir, SceneReader &sr) {
+	if(!fragmentInfo.validHit) {
+		return glm::vec3(0, 0, 0);
+	}
 
-    glm::vec3 lambert = material->diffuseColor * lightColor * lambertShade;
-    // phong shading
-    glm::vec3 halfvec = glm::normalize(glm::normalize(shadowray_direction) + glm::normalize(-rayDir));
+	// local and specular color of every hit on the path. The color of each bounce is clamped before
+	// it gets reflected, so they are combined back to front once the path ended
+	glm::vec3 localColors[SceneReader::maxDepthLimit + 1];
+	glm::vec3 specularColors[SceneReader::maxDepthLimit + 1];
+	glm::vec3 throughput(1, 1, 1);
+	int hits = 0;
+
+	while(true) {
+		const Material &material = sr.materials[fragmentInfo.materialIndex];
+		localColors[hits] = material.ambientColor + material.emissionColor + shadowRayTest(fragmentInfo, rayDir, sr);
+		specularColors[hits] = material.specularColor;
+		hits++;
+
+		throughput *= material.specularColor;
+		if(hits > sr.maxDepth || glm::max(throughput[0], glm::max(throughput[1], throughput[2])) <= sr.minThroughput) {
+			break;
+		}
 
-    const float phongShade = clamp(glm::dot(halfvec, fragmentNormal));
+		// calculate reflectionRay, fragment is in world space
+		glm::vec3 viewDir = glm::normalize(-rayDir);
+		glm::vec3 reflectedDir = (2 * glm::dot(viewDir, fragmentInfo.normal) * fragmentInfo.normal) - viewDir;
+		glm::vec3 reflectedPos = fragmentInfo.position + sr.epsilonBias * reflectedDir;
 
-    const float shinePow = glm::pow(std::max(phongShade, 0.f), material->shininess);
-    glm::vec3 phong = material->specularColor * lightColor * shinePow;
+		COUNT_STATISTIC(STAT_REFLECTION_RAYS, 1);
+		fragmentInfo = sr.scene_content->intersect(reflectedPos, glm::normalize(reflectedDir));
+		if(!fragmentInfo.validHit) {
+			break;
+		}
+		rayDir = reflectedDir;
+	}
 
-    return lambert + phong;
+	glm::vec3 color(0, 0, 0);
+	for(int hit = hits - 1; hit >= 0; hit--) {
+		color = clampRGB(localColors[hit] + specularColors[hit] * color);
+	}
+	return color;
 }
 
-glm::vec3 shadowRayTest(FragmentInfo fragmentInfo, glm::vec3 rayDir, SceneReader &sr) {
-	glm::vec3 shadowColor(0, 0, 0);
-	Material *material = fragmentInfo.material;
+glm::vec3 trace(glm::vec3 rayOrigin, glm::vec3 rayDir, SceneReader &sr) {
+	FragmentInfo fragmentInfo = sr.scene_content->intersect(rayOrigin, glm::normalize(rayDir));
+	return shade(fragmentInfo, rayDir, sr);
+}
 
-	for(auto const& light : sr.lights) {
-        if(light.type == LightType::POINT) {
-            glm::vec3 shadowray_direction = glm::normalize(light.position - fragmentInfo.position);
-            glm::vec3 shadowray_origin = fragmentInfo.position + sr.epsilonBias * shadowray_direction;
-            float t_toLight = glm::dot(light.position - fragmentInfo.position, shadowray_direction);	// is distance on normalized ray, avoids square root
+// traces the primary ray of pixel x, y and records its hit in sampler if given.
+// Statistics builds record the counters of the pixel
+inline glm::vec3 tracePixel(int x, int y, SceneReader &sr, FrameStatistics *statistics, AdaptiveSampler *sampler = nullptr) {
+#if RAYTRACER_STATISTICS
+	statistics->beginPixel();
+	COUNT_STATISTIC(STAT_PRIMARY_RAYS, 1);
+#endif
+	const glm::vec3 rayDir = sr.camera.getRayAt(x, y);
+	FragmentInfo fragmentInfo = sr.scene_content->intersect(sr.camera.eye, glm::normalize(rayDir));
+	if(sampler) {
+		sampler->setHitId(x, y, fragmentInfo.geometry_ptr);
+	}
+	glm::vec3 color = shade(fragmentInfo, rayDir, sr);
+#if RAYTRACER_STATISTICS
+	statistics->endPixel(x, y);
+#endif
+	return color;
+}
 
-            FragmentInfo shadowHitInfo = sr.scene_content->intersect(shadowray_origin, shadowray_direction, t_toLight);
+// traces all pixels of a tile, primary rays in packets if packetSize > 0. Stage by stage if wavefront is given,
+// the primary hits are recorded in sampler if given (not in wavefront mode)
+void renderTile(const Tile &tile, SceneReader &sr, Image3f &image, BVH *bvh, int packetSize, FrameStatistics *statistics,
+				Wavefront *wavefront = nullptr, AdaptiveSampler *sampler = nullptr) {
+	if(wavefront) {
+		wavefront->render(tile, sr, image, bvh, packetSize);
+	}
+	else if(packetSize > 0) {
+		RayPacket packet;
+		FragmentInfo fragmentInfos[RayPacket::maxSize];
+		for(int y = tile.y0; y < tile.y1; y += packetSize) {
+			for(int x = tile.x0; x < tile.x1; x += packetSize) {
+				sr.camera.getRayPacket(x, y, packetSize, packet);
+
+				bvh->intersectPacket(packet, fragmentInfos);
+				for(int lane = 0; lane < packet.size; lane++) {
+					image.setAt(packet.px[lane], packet.py[lane], shade(fragmentInfos[lane], packet.getDirection(lane), sr));
+					if(sampler) {
+						sampler->setHitId(packet.px[lane], packet.py[lane], fragmentInfos[lane].geometry_ptr);
+					}
+				}
+			}
+		}
+	}
+	else {
+		for(int y = tile.y0; y < tile.y1; y++) {
+			for(int x = tile.x0; x < tile.x1; x++) {
+				image.setAt(x, y, tracePixel(x, y, sr, statistics, sampler));
+			}
+		}
+	}
+}
 
-            if(!shadowHitInfo.validHit) {
-                float attenuation = light.attenuation[0]
-                            + light.attenuation[1] * t_toLight
-                            + light.attenuation[2] * t_toLight * t_toLight;
+// replaces the pixels of tile the sampler marked as edges by the mean of their stratified samples
+void supersampleTile(const Tile &tile, SceneReader &sr, Image3f &image, FrameStatistics *statistics, const AdaptiveSampler &sampler) {
+	for(int y = tile.y0; y < tile.y1; y++) {
+		for(int x = tile.x0; x < tile.x1; x++) {
+			if(!sampler.isEdge(x, y)) {
+				continue;
+			}
+#if RAYTRACER_STATISTICS
+			statistics->resumePixel(x, y);
+#endif
+			glm::vec3 color(0, 0, 0);
+			for(int sample = 0; sample < sampler.sampleCount(); sample++) {
+				const glm::vec2 position = sampler.samplePosition(x, y, sample);
+				COUNT_STATISTIC(STAT_PRIMARY_RAYS, 1);
+				color += trace(sr.camera.eye, sr.camera.getRayThrough(position.x, position.y), sr);
+			}
+#if RAYTRACER_STATISTICS
+			statistics->endPixel(x, y);
+#endif
+			image.setAt(x, y, color / float(sampler.sampleCount()));
+		}
+	}
+}
 
-                shadowColor += calc_lighting(rayDir, shadowray_direction, fragmentInfo.normal, material, light.color) / attenuation;
-            }
-        }
-        else if(light.type == LightType::DIRECTIONAL) {
-            glm::vec3 shadowray_direction = glm::normalize(light.position);
-            glm::vec3 shadowray_origin = fragmentInfo.position + sr.epsilonBias * shadowray_direction;
-            FragmentInfo shadowHitInfo = sr.scene_content->intersect(shadowray_origin, shadowray_direction);
+// one pass of progressive rendering: traces the pixels on the lattice of spacing step that no coarser pass
+// traced yet, then fills every other pixel with the traced pixel of its step x step block.
+// Tiles have to start on a multiple of the first pass' step, so blocks never cross tiles.
+void renderProgressiveTile(const Tile &tile, SceneReader &sr, Image3f &image, int step, bool firstPass, FrameStatistics *statistics) {
+	for(int y = tile.y0; y < tile.y1; y += step) {
+		for(int x = tile.x0; x < tile.x1; x += step) {
+			if(!firstPass && x % (2 * step) == 0 && y % (2 * step) == 0) {
+				continue;
+			}
+			image.setAt(x, y, tracePixel(x, y, sr, statistics));
+		}
+	}
 
-            if(!shadowHitInfo.validHit) {
-                shadowColor += calc_lighting(rayDir, shadowray_direction, fragmentInfo.normal, material, light.color);
-            }
-        }
+	if(step > 1) {
+		for(int y = tile.y0; y < tile.y1; y++) {
+			for(int x = tile.x0; x < tile.x1; x++) {
+				if(x % step != 0 || y % step != 0) {
+					image.setAt(x, y, image.getAt(x - x % step, y - y % step));
+				}
+			}
+		}
 	}
+}
 
-	return clampRGB(shadowColor);
+// how raytrace() renders a scene
+struct RenderSettings {
+	AccelerationType accelerationType = AccelerationType::BVH;
+	int packetSize = 8;		// > 0 traces primary rays in packets of packetSize x packetSize pixels (BVH only, max 8)
+	int tileSize = 32;		// edge length of the scheduled tiles, rounded up to a multiple of packetSize
+	int threadCount = 0;	// <= 0 uses all available threads
+	bool printSchedulerStatistics = true;
+
+	// > 1 renders progressively: the first pass traces one pixel per progressiveStep x progressiveStep block
+	// (rounded down to a power of two), each further pass halves the spacing. The final image is the same
+	int progressiveStep = 0;
+	std::string progressiveOutput = "";	// image file updated after each pass, the preview window is used if empty
+
+	bool useSceneCache = true;	// load the scene and its BVH from scene.test.rtcache, written on the first run
+
+	// statistics builds (RAYTRACER_STATISTICS) write one heatmap per counter next to the render
+	bool writeHeatmaps = true;
+
+	bool headless = false;				// never opens a window, the image is always written
+	std::string outputFilename = "";	// overrides the output of the scene file, .ppm or any format opencv writes
+	int width = 0;						// width and height > 0 override the resolution of the scene file
+	int height = 0;
+	PixelLayout pixelLayout = PixelLayout::INTERLEAVED;	// planar frames are merged for the preview window
+
+	// reflection paths end once the product of their specular colors is at most this, 0 only skips black ones
+	float minThroughput = 1.f / 256;
+
+	// > 0 skips lights that can add at most this to every channel of a fragment without a shadow ray, point lights
+	// with falloff are only looked at within the distance they can add more. The skipped light of many lights
+	// adds up, so it is off (0) by default
+	float lightThreshold = 0;
+
+	std::vector<Camera> cameras;	// replace the camera commands and keyframes of the scene file, one frame each
+	int frameCount = 0;				// > 0 overrides the frame count of a keyframed camera path
+
+	// writes finished tiles straight into the .ppm or .pfm output instead of keeping the frame in memory.
+	// Nothing is displayed and progressive rendering is turned off
+	bool streamOutput = false;
+
+	// renders tiles stage by stage with ray queues instead of path by path, see wavefront.h. The image is the
+	// same. Not used for progressive passes and in statistics builds
+	bool wavefront = false;
+
+	// > 1 supersamples pixels whose color or primary hit differs from a neighbour's with antiAliasing x antiAliasing
+	// stratified samples, all others keep their one center ray. Turns progressive rendering off, in memory
+	// frames only
+	int antiAliasing = 1;
+	float antiAliasingThreshold = 0.1f;	// largest channel difference to a neighbour that isn't an edge
+
+#ifdef RAYTRACER_DISTRIBUTED
+	TileCoordinator *coordinator = nullptr;	// renders the tiles on its workers instead of this process' threads
+#endif
+};
+
+// loads the scene and applies the settings that change it
+void prepareScene(SceneReader &sr, const std::string &scenefilename, const RenderSettings &settings) {
+	loadScene(sr, scenefilename, settings.accelerationType, settings.useSceneCache);
+	if(settings.width > 0 && settings.height > 0) {
+		sr.camera.width = settings.width;
+		sr.camera.height = settings.height;
+	}
+	sr.camera.updateAxes();
+	sr.minThroughput = settings.minThroughput;
+	sr.lightCuller.build(sr.lights, sr.materials, settings.lightThreshold);
 }
 
-glm::vec3 trace(glm::vec3 rayOrigin, glm::vec3 rayDir, SceneReader &sr, const float maxDepth = 5) {
-	FragmentInfo fragmentInfo = sr.scene_content->intersect(rayOrigin, glm::normalize(rayDir));
-	if(fragmentInfo.validHit) {
-		glm::vec3 reflectionColor(0, 0, 0);
-		if(maxDepth > 0) {
-			// calculate reflectionRay, fragment is in world space
-			glm::vec3 fragmentNormal = fragmentInfo.normal;
-			glm::vec3 viewDir = glm::normalize(-rayDir);
+// packets need a BVH and whole tiles, statistics are counted per pixel which shared packet traversal can't attribute
+int effectivePacketSize(SceneReader &sr, const RenderSettings &settings, int progressiveStep) {
+	return dynamic_cast<BVH*>(sr.scene_content.get()) && progressiveStep == 1 && !RAYTRACER_STATISTICS
+			? std::min(settings.packetSize, 8) : 0;
+}
+
+// tile size rounded up to a multiple of the packets and of the first progressive pass' step
+int effectiveTileSize(const RenderSettings &settings, int packetSize, int progressiveStep) {
+	const int tileAlignment = std::max({packetSize, progressiveStep, 1});
+	return (std::max(settings.tileSize, 1) + tileAlignment - 1) / tileAlignment * tileAlignment;
+}
+
+// renders sr.camera into frame, which gets allocated if it doesn't fit, or streams it into filename
+bool renderFrame(SceneReader &sr, const std::string &scenefilename, const RenderSettings &settings,
+				 const std::string &filename, std::unique_ptr<Image3f> &frame) {
+	const int width = sr.camera.width;
+	const int height = sr.camera.height;
+	const bool streaming = settings.streamOutput && ImageStreamWriter::supports(filename);
+	if(settings.streamOutput && !streaming) {
+		std::cout << "streaming needs a .ppm or .pfm output, rendering " << filename << " in memory" << std::endl;
+	}
 
-			glm::vec3 reflectedDir = (2 * glm::dot(viewDir, fragmentNormal) *fragmentNormal) - viewDir;
+	bool distributed = false;
+#ifdef RAYTRACER_DISTRIBUTED
+	distributed = settings.coordinator != nullptr;
+#endif
 
-			glm::vec3 reflectedPos = fragmentInfo.position + sr.epsilonBias * reflectedDir;
-			reflectionColor = trace(reflectedPos, reflectedDir, sr, maxDepth - 1);
+	AdaptiveSampler sampler;
+	sampler.samplesPerAxis = streaming || distributed ? 1 : std::max(settings.antiAliasing, 1);
+	sampler.contrastThreshold = settings.antiAliasingThreshold;
+	if(settings.antiAliasing > 1 && !sampler.enabled()) {
+		std::cout << "anti-aliasing needs the whole frame in memory, rendering " << filename << " without it" << std::endl;
+	}
+
+	int progressiveStep = 1;
+	while(!streaming && !distributed && !sampler.enabled() && progressiveStep * 2 <= settings.progressiveStep) {
+		progressiveStep *= 2;
+	}
+
+	// progressive passes trace single rays, packets only pay off for full tiles
+	BVH *bvh = dynamic_cast<BVH*>(sr.scene_content.get());
+	const int packetSize = effectivePacketSize(sr, settings, progressiveStep);
+	const int tileSize = effectiveTileSize(settings, packetSize, progressiveStep);
+	TileScheduler scheduler(width, height, tileSize, settings.threadCount);
+
+#if RAYTRACER_STATISTICS
+	FrameStatistics frameStatistics(width, height);
+	FrameStatistics *statistics = &frameStatistics;
+#else
+	FrameStatistics *statistics = nullptr;
+#endif
+
+	// statistics are counted per pixel, which the stages of the wavefront mode can't attribute
+	std::vector<Wavefront> wavefronts(settings.wavefront && !RAYTRACER_STATISTICS ? scheduler.getThreadCount() : 0);
+	auto wavefront = [&]() {
+		return wavefronts.empty() ? nullptr : &wavefronts[omp_get_thread_num()];
+	};
+
+	// a streamed frame only exists as one tile buffer per thread
+	std::unique_ptr<ImageStreamWriter> stream;
+	std::vector<std::unique_ptr<Image3f>> tileBuffers;
+	if(streaming) {
+		frame.reset();
+		stream = std::make_unique<ImageStreamWriter>(filename, width, height);
+		if(!stream->isOpen()) {
+			std::cout << "could not open " << filename << std::endl;
+			return false;
+		}
+		for(int thread = 0; thread < scheduler.getThreadCount(); thread++) {
+			tileBuffers.push_back(std::make_unique<Image3f>(tileSize, tileSize, settings.pixelLayout));
 		}
+	}
+	else if(!frame || frame->width != width || frame->height != height || frame->layout != settings.pixelLayout) {
+		frame = std::make_unique<Image3f>(width, height, settings.pixelLayout);
+	}
+	std::cout<<"setting background"<<std::endl;
 
-		// shadowray
-		glm::vec3 shadowColor = shadowRayTest(fragmentInfo, rayDir, sr);
+	std::cout<<"start raytrace" << std::endl;
+	sr.occluderCaches.assign(scheduler.getThreadCount(), OccluderCache(sr.lights.size()));
 
-		return clampRGB( fragmentInfo.material->ambientColor
-                       + fragmentInfo.material->emissionColor
-                       + shadowColor
-                       + fragmentInfo.material->specularColor * reflectionColor);
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if(progressiveStep > 1) {
+		for(int step = progressiveStep; step >= 1; step /= 2) {
+			scheduler.run([&](const Tile &tile) {
+				renderProgressiveTile(tile, sr, *frame, step, step == progressiveStep, statistics);
+			});
+
+			std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+			std::cout << "pass with step " << step << " done after " << elapsed.count() << " seconds" << std::endl;
+			if(step > 1) {
+				if(!settings.progressiveOutput.empty()) {
+					frame->save(settings.progressiveOutput);
+				}
+				else if(!settings.headless) {
+					frame->display(1);
+				}
+			}
+		}
+	}
+#ifdef RAYTRACER_DISTRIBUTED
+	else if(distributed) {
+		// workers split the tiles they get between their threads again
+		const WorkerJob job = { int(settings.accelerationType), width, height, packetSize, tileSize,
+				settings.useSceneCache, settings.minThroughput, settings.lightThreshold, sr.camera };
+		const std::string scenePath = std::filesystem::absolute(scenefilename).string();
+		TileScheduler distributedTiles(width, height, 4 * tileSize);
+		std::unique_ptr<Image3f> tileBuffer;
+
+		settings.coordinator->run(distributedTiles.getTiles(), job, scenePath, [&](const Tile &tile, const float *rgb) {
+			const int tileWidth = tile.x1 - tile.x0;
+			if(stream) {
+				tileBuffer = std::make_unique<Image3f>(tileWidth, tile.y1 - tile.y0, settings.pixelLayout);
+				tileBuffer->setOrigin(tile.x0, tile.y0);
+			}
+			Image3f &target = stream ? *tileBuffer : *frame;
+			for(int y = tile.y0; y < tile.y1; y++) {
+				for(int x = tile.x0; x < tile.x1; x++) {
+					const float *color = rgb + (size_t(y - tile.y0) * tileWidth + (x - tile.x0)) * 3;
+					target.setAt(x, y, glm::vec3(color[0], color[1], color[2]));
+				}
+			}
+			if(stream) {
+				stream->writeTile(target, tile.x0, tile.y0, tile.x1, tile.y1);
+			}
+		});
+	}
+#endif
+	else if(streaming) {
+		scheduler.run([&](const Tile &tile) {
+			Image3f &tileBuffer = *tileBuffers[omp_get_thread_num()];
+			tileBuffer.setOrigin(tile.x0, tile.y0);
+			renderTile(tile, sr, tileBuffer, bvh, packetSize, statistics, wavefront());
+			stream->writeTile(tileBuffer, tile.x0, tile.y0, tile.x1, tile.y1);
+		});
+	}
+	else if(sampler.enabled()) {
+		// edges are found between all traced pixels, before any of them gets supersampled
+		sampler.reset(width, height);
+		scheduler.run([&](const Tile &tile) {
+			renderTile(tile, sr, *frame, bvh, packetSize, statistics, nullptr, &sampler);
+		});
+		std::atomic<size_t> edgePixels = 0;
+		scheduler.run([&](const Tile &tile) {
+			edgePixels += sampler.markEdges(tile, *frame);
+		});
+		scheduler.run([&](const Tile &tile) {
+			supersampleTile(tile, sr, *frame, statistics, sampler);
+		});
+		std::cout << "supersampled " << edgePixels << " of " << size_t(width) * height << " pixels with "
+				<< sampler.sampleCount() << " samples" << std::endl;
 	}
 	else {
-		return glm::vec3(0, 0, 0);
+		scheduler.run([&](const Tile &tile) {
+			renderTile(tile, sr, *frame, bvh, packetSize, statistics, wavefront());
+		});
 	}
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed = finish - start;
+	std::cout << "finished raytracing after " << elapsed.count() << " seconds" << std::endl;
+	if(settings.printSchedulerStatistics && !distributed) {
+		scheduler.printStatistics();
+	}
+#ifdef RAYTRACER_DISTRIBUTED
+	if(settings.printSchedulerStatistics && distributed) {
+		settings.coordinator->printStatistics();
+	}
+#endif
+
+	if(streaming) {
+		if(!stream->close()) {
+			std::cout << "could not write " << filename << std::endl;
+			return false;
+		}
+		std::cout << "Written to: " << filename << std::endl;
+	}
+
+#if RAYTRACER_STATISTICS
+	statistics->printTotals();
+	if(settings.writeHeatmaps) {
+		statistics->writeHeatmaps(filename.substr(0, filename.find_last_of('.')));
+	}
+#endif
+	return true;
 }
 
-void raytrace(std::string scenefilename) {
+// renders every frame of one scene, returns false if there was nothing to render
+bool raytrace(std::string scenefilename, RenderSettings settings = RenderSettings()) {
 	SceneReader sr;
-	sr.readScene(scenefilename, true);
-	sr.camera.updateAxes();
+	prepareScene(sr, scenefilename, settings);
+	if(!sr.scene_content) {
+		std::cout << "could not read " << scenefilename << std::endl;
+		return false;
+	}
 
 	std::cout<<"initialize image buffer space"<<std::endl;
 	const int width = sr.camera.width;
 	const int height = sr.camera.height; // image dims
 	std::cout<<"Image " << width << " " << height <<std::endl;
+	if(width <= 0 || height <= 0) {
+		std::cout << "nothing to render for " << scenefilename << std::endl;
+		return false;
+	}
 
-	Image3f image(width, height);
-	std::cout<<"setting background"<<std::endl;
+	std::string filename = !settings.outputFilename.empty() ? settings.outputFilename
+			: sr.outputFilename.empty() ? "raytrace.png" :  sr.outputFilename;
 
-	std::cout<<"start raytrace" << std::endl;
+	if(!settings.cameras.empty()) {
+		sr.cameras = settings.cameras;
+		sr.keyframes.clear();
+	}
+	const std::vector<Camera> cameras = sr.frameCameras(settings.frameCount);
 
-	auto start = std::chrono::high_resolution_clock::now();
+	if(cameras.size() == 1) {
+		sr.camera = cameras.front();
+		std::unique_ptr<Image3f> frame;
+		if(!renderFrame(sr, scenefilename, settings, filename, frame)) {
+			return false;
+		}
+		if(!frame) {
+			return true;	// streamed
+		}
 
-	#pragma omp parallel for
-	for(int y = 0; y < height; y++) {
-		for(int x = 0; x < width; x++) {
-			glm::vec3 rayDir = sr.camera.getRayAt(x, y);
+		if(settings.headless || !settings.outputFilename.empty() || !sr.outputFilename.empty()) {
+			if(!settings.headless) {
+				frame->display(0);
+			}
+			frame->save(filename);
+		}
+		else if(frame->display(0) == 10) {
+			frame->save(filename);
+		}
+		return true;
+	}
 
-            image.setAt(x, y, trace(sr.camera.eye, rayDir, sr, 5));
+	// The scene and its acceleration structure are shared by all frames, which are written as filename_0000.png...
+	// A frame is encoded on a second thread while the next one is traced. Two framebuffers take turns,
+	// so a framebuffer only gets traced into again once its last frame has been written
+	std::unique_ptr<Image3f> frames[2];
+	std::future<void> encoding[2];
+	bool rendered = true;
+	for(size_t i = 0; i < cameras.size() && rendered; i++) {
+		const int slot = int(i % 2);
+		if(encoding[slot].valid()) {
+			encoding[slot].get();
+		}
+
+		char number[32];
+		std::snprintf(number, sizeof(number), "_%04zu", i);
+		const std::filesystem::path path(filename);
+		const std::string frameFilename = (path.parent_path() / (path.stem().string() + number + path.extension().string())).string();
+
+		std::cout << "frame " << i + 1 << " of " << cameras.size() << std::endl;
+		sr.camera = cameras[i];
+		rendered = renderFrame(sr, scenefilename, settings, frameFilename, frames[slot]);
+		if(rendered && frames[slot]) {
+			if(!settings.headless) {
+				frames[slot]->display(1);
+			}
+			Image3f *frame = frames[slot].get();
+			encoding[slot] = std::async(std::launch::async, [frame, frameFilename]() {
+				frame->save(frameFilename);
+			});
+		}
+	}
+	for(auto &frameEncoding : encoding) {
+		if(frameEncoding.valid()) {
+			frameEncoding.get();
 		}
 	}
+	return rendered;
+}
 
-	auto finish = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double> elapsed = finish - start;
-	std::cout << "finished raytracing after " << elapsed.count() << " seconds" << std::endl;
+#ifdef RAYTRACER_DISTRIBUTED
+// worker process of a distributed render, renders the tiles the coordinator at host:port sends with threadCount threads
+bool renderWorker(const std::string &host, const std::string &port, int threadCount) {
+	std::unique_ptr<SceneReader> sr;
+	std::unique_ptr<FrameStatistics> statistics;	// only counted in statistics builds, never sent back
+	WorkerJob currentJob = {};
+	std::string currentScene;
+
+	auto loadJob = [&](const WorkerJob &job, const std::string &scenePath) {
+		// frames of the same scene and settings reuse the loaded scene
+		const bool sameScene = sr && scenePath == currentScene && job.accelerationType == currentJob.accelerationType
+				&& job.useSceneCache == currentJob.useSceneCache && job.minThroughput == currentJob.minThroughput
+				&& job.lightThreshold == currentJob.lightThreshold;
+		if(sameScene) {
+			sr->camera = job.camera;
+			if(RAYTRACER_STATISTICS && (job.width != currentJob.width || job.height != currentJob.height)) {
+				statistics = std::make_unique<FrameStatistics>(job.width, job.height);
+			}
+			currentJob = job;
+			return true;
+		}
+		RenderSettings settings;
+		settings.accelerationType = AccelerationType(job.accelerationType);
+		settings.width = job.width;
+		settings.height = job.height;
+		settings.useSceneCache = job.useSceneCache != 0;
+		settings.minThroughput = job.minThroughput;
+		settings.lightThreshold = job.lightThreshold;
+
+		sr = std::make_unique<SceneReader>();
+		prepareScene(*sr, scenePath, settings);
+		if(!sr->scene_content) {
+			return false;
+		}
+		sr->camera = job.camera;
+		sr->occluderCaches.assign(threadCount > 0 ? threadCount : omp_get_max_threads(), OccluderCache(sr->lights.size()));
+		if(RAYTRACER_STATISTICS) {
+			statistics = std::make_unique<FrameStatistics>(job.width, job.height);
+		}
+		currentJob = job;
+		currentScene = scenePath;
+		return true;
+	};
+
+	auto renderJobTile = [&](const Tile &tile, std::vector<float> &rgb) {
+		const int tileWidth = tile.x1 - tile.x0;
+		const int tileHeight = tile.y1 - tile.y0;
+		Image3f image(tileWidth, tileHeight);
+		image.setOrigin(tile.x0, tile.y0);
+
+		BVH *bvh = dynamic_cast<BVH*>(sr->scene_content.get());
+		TileScheduler scheduler(tileWidth, tileHeight, currentJob.tileSize, threadCount);
+		scheduler.run([&](const Tile &subTile) {
+			const Tile frameTile = { tile.x0 + subTile.x0, tile.y0 + subTile.y0, tile.x0 + subTile.x1, tile.y0 + subTile.y1 };
+			renderTile(frameTile, *sr, image, bvh, currentJob.packetSize, statistics.get());
+		});
+
+		rgb.resize(size_t(tileWidth) * tileHeight * 3);
+		for(int y = tile.y0; y < tile.y1; y++) {
+			image.rowTo3f(y, tile.x0, tile.x1, rgb.data() + size_t(y - tile.y0) * tileWidth * 3);
+		}
+	};
 
-	int k = image.display(0);
+	return runWorker(host, port, loadJob, renderJobTile);
+}
+#endif
+
+void printUsage(std::ostream &out) {
+	out << "usage: raytracing [options] scene.test ...\n"
+		<< "Renders the scenes one after another without a window and writes the images.\n"
+		<< "  -o, --output PATH         image file, for several scenes the directory they are written to\n"
+		<< "  -f, --format EXT          format of the images in an output directory: png (default), ppm, ...\n"
+		<< "  -t, --threads N           render threads, all available by default\n"
+		<< "  -r, --resolution WxH      overrides the size of the scene files\n"
+		<< "  -a, --accel TYPE          bvh (default), grid or container\n"
+		<< "      --min-throughput X    end reflection paths with less specular throughput, 1/256 by default\n"
+		<< "      --light-threshold X   skip lights adding at most X to a fragment without a shadow ray, 0 (off) by default\n"
+		<< "      --camera E,C,U,FOV    render this view instead of the scene's cameras: eye, center and up as x,y,z\n"
+		<< "                            and the field of view, 10 numbers. Repeat it for several frames\n"
+		<< "      --frames N            frames along the keyframed camera path of the scene\n"
+		<< "      --stream              write finished tiles straight into a .ppm or .pfm output, no framebuffer\n"
+		<< "      --progressive N       first pass traces one pixel per N x N block, each pass halves it. Ignored\n"
+		<< "                            with --stream, --coordinator and --aa\n"
+		<< "      --progressive-output PATH  image updated after each progressive pass, the window with --display\n"
+		<< "      --wavefront           trace tiles stage by stage with ray queues sorted by material and direction\n"
+		<< "      --aa N                supersample edge pixels with N x N stratified samples, 1 (off) by default\n"
+		<< "      --aa-threshold X      color difference to a neighbour that makes a pixel an edge, 0.1 by default\n"
+		<< "      --no-cache            don't read or write scene.test.rtcache files\n"
+		<< "      --display             show every image in a window before it is written\n"
+#ifdef RAYTRACER_DISTRIBUTED
+		<< "      --coordinator PORT    render the tiles on worker processes connecting to PORT\n"
+		<< "      --spawn-workers N     start N local workers for the coordinator, with --threads threads each\n"
+		<< "      --worker HOST:PORT    render tiles for the coordinator at HOST:PORT until it is done, no scenes needed\n"
+#endif
+		<< "Without arguments res/scene7.test is rendered and shown." << std::endl;
+}
 
-	if(k == 10 || !sr.outputFilename.empty()) {
-		std::string filename =
-				sr.outputFilename.empty() ? "raytrace.png" :  sr.outputFilename;
-		image.save(filename);
+int main(int argc, char **argv) {
+	if(argc < 2) {
+//		raytrace("res/test.test");
+//		raytrace("res/scene1.test");			// Triangle
+//		raytrace("res/scene2.test");			// Würfel
+//		raytrace("res/scene3.test");			// table
+
+//		raytrace("res/scene4-ambient.test");	// table
+//		raytrace("res/scene4-diffuse.test");
+//		raytrace("res/scene4-emission.test");
+//		raytrace("res/scene4-specular.test");
+		// raytrace("res/scene5.test");		// many spheres
+		// raytrace("res/scene6.test");		// cornell box
+		raytrace("res/scene7.test");		// dragon
+
+		return 0;
 	}
-}
 
-int main() {
-//	raytrace("res/test.test");
-//	raytrace("res/scene1.test");			// Triangle
-//	raytrace("res/scene2.test");			// Würfel
-//	raytrace("res/scene3.test");			// table
+	RenderSettings settings;
+	settings.headless = true;
+	std::string output = "";
+	std::string format = "png";
+	std::vector<std::string> scenes;
+	int coordinatorPort = -1;
+	int spawnWorkers = 0;
+	std::string workerAddress = "";
+
+	for(int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if((arg == "-o" || arg == "--output") && hasValue) {
+			output = argv[++i];
+		}
+		else if((arg == "-f" || arg == "--format") && hasValue) {
+			format = argv[++i];
+		}
+		else if((arg == "-t" || arg == "--threads") && hasValue) {
+			settings.threadCount = std::atoi(argv[++i]);
+		}
+		else if((arg == "-r" || arg == "--resolution") && hasValue) {
+			if(std::sscanf(argv[++i], "%dx%d", &settings.width, &settings.height) != 2 || settings.width <= 0 || settings.height <= 0) {
+				std::cerr << "invalid resolution " << argv[i] << ", expected WxH" << std::endl;
+				return 2;
+			}
+		}
+		else if((arg == "-a" || arg == "--accel") && hasValue) {
+			const std::string type = argv[++i];
+			if(type == "bvh") {
+				settings.accelerationType = AccelerationType::BVH;
+			}
+			else if(type == "grid") {
+				settings.accelerationType = AccelerationType::GRID;
+			}
+			else if(type == "container") {
+				settings.accelerationType = AccelerationType::CONTAINER;
+			}
+			else {
+				std::cerr << "unknown acceleration structure " << type << std::endl;
+				return 2;
+			}
+		}
+		else if(arg == "--min-throughput" && hasValue) {
+			settings.minThroughput = float(std::atof(argv[++i]));
+		}
+		else if(arg == "--light-threshold" && hasValue) {
+			settings.lightThreshold = float(std::atof(argv[++i]));
+		}
+		else if(arg == "--camera" && hasValue) {
+			Camera camera;
+			if(std::sscanf(argv[++i], "%f,%f,%f,%f,%f,%f,%f,%f,%f,%f", &camera.eye.x, &camera.eye.y, &camera.eye.z,
+					&camera.center.x, &camera.center.y, &camera.center.z,
+					&camera.worldUp.x, &camera.worldUp.y, &camera.worldUp.z, &camera.fovDeg) != 10) {
+				std::cerr << "invalid camera " << argv[i] << ", expected 10 comma separated numbers" << std::endl;
+				return 2;
+			}
+			settings.cameras.push_back(camera);
+		}
+		else if(arg == "--frames" && hasValue) {
+			settings.frameCount = std::atoi(argv[++i]);
+		}
+		else if(arg == "--progressive" && hasValue) {
+			settings.progressiveStep = std::atoi(argv[++i]);
+		}
+		else if(arg == "--progressive-output" && hasValue) {
+			settings.progressiveOutput = argv[++i];
+		}
+		else if(arg == "--stream") {
+			settings.streamOutput = true;
+		}
+		else if(arg == "--wavefront") {
+			settings.wavefront = true;
+		}
+		else if(arg == "--aa" && hasValue) {
+			settings.antiAliasing = std::atoi(argv[++i]);
+		}
+		else if(arg == "--aa-threshold" && hasValue) {
+			settings.antiAliasingThreshold = float(std::atof(argv[++i]));
+		}
+		else if(arg == "--no-cache") {
+			settings.useSceneCache = false;
+		}
+		else if(arg == "--display") {
+			settings.headless = false;
+		}
+#ifdef RAYTRACER_DISTRIBUTED
+		else if(arg == "--coordinator" && hasValue) {
+			coordinatorPort = std::atoi(argv[++i]);
+		}
+		else if(arg == "--spawn-workers" && hasValue) {
+			spawnWorkers = std::atoi(argv[++i]);
+		}
+		else if(arg == "--worker" && hasValue) {
+			workerAddress = argv[++i];
+		}
+#endif
+		else if(arg == "-h" || arg == "--help") {
+			printUsage(std::cout);
+			return 0;
+		}
+		else if(!arg.empty() && arg[0] == '-') {
+			std::cerr << "unknown option " << arg << std::endl;
+			printUsage(std::cerr);
+			return 2;
+		}
+		else {
+			scenes.push_back(arg);
+		}
+	}
 
-//	raytrace("res/scene4-ambient.test");	// table
-//	raytrace("res/scene4-diffuse.test");
-//	raytrace("res/scene4-emission.test");
-//	raytrace("res/scene4-specular.test");
-	// raytrace("res/scene5.test");		// many spheres
-	// raytrace("res/scene6.test");		// cornell box
-	raytrace("res/scene7.test");		// dragon
+#ifdef RAYTRACER_DISTRIBUTED
+	if(!workerAddress.empty()) {
+		const size_t colon = workerAddress.find_last_of(':');
+		if(colon == std::string::npos) {
+			std::cerr << "invalid coordinator address " << workerAddress << ", expected HOST:PORT" << std::endl;
+			return 2;
+		}
+		return renderWorker(workerAddress.substr(0, colon), workerAddress.substr(colon + 1), settings.threadCount) ? 0 : 1;
+	}
+#endif
+
+	if(scenes.empty()) {
+		printUsage(std::cerr);
+		return 2;
+	}
+
+#ifdef RAYTRACER_DISTRIBUTED
+	std::unique_ptr<TileCoordinator> coordinator;
+	std::vector<pid_t> localWorkers;
+	if(coordinatorPort >= 0 || spawnWorkers > 0) {
+		coordinator = std::make_unique<TileCoordinator>(std::max(coordinatorPort, 0));
+		if(!coordinator->isListening()) {
+			std::cerr << "could not listen on port " << coordinatorPort << std::endl;
+			return 1;
+		}
+		std::cout << "coordinating on port " << coordinator->getPort() << std::endl;
+		settings.coordinator = coordinator.get();
+		localWorkers = spawnLocalWorkers(argv[0], coordinator->getPort(), spawnWorkers, settings.threadCount);
+	}
+#endif
+
+	// a single scene is written to the output file, several into the output directory named after the scene
+	const bool outputDirectory = !output.empty() && scenes.size() > 1;
+	if(outputDirectory) {
+		std::error_code error;
+		std::filesystem::create_directories(output, error);
+	}
 
+	// all scenes render in this process, so the OpenMP threads are only started once
+	int failed = 0;
+	for(auto const& scene : scenes) {
+		RenderSettings sceneSettings = settings;
+		if(outputDirectory) {
+			sceneSettings.outputFilename = (std::filesystem::path(output) / std::filesystem::path(scene).stem()).string() + "." + format;
+		}
+		else {
+			sceneSettings.outputFilename = output;
+		}
+		if(!raytrace(scene, sceneSettings)) {
+			failed++;
+		}
+	}
+
+#ifdef RAYTRACER_DISTRIBUTED
+	if(coordinator) {
+		coordinator->finish();
+		waitForLocalWorkers(localWorkers);
+	}
+#endif
+
+	if(failed > 0) {
+		std::cerr << failed << " of " << scenes.size() << " scenes could not be rendered" << std::endl;
+		return 1;
+	}
 	return 0;
 }
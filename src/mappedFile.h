@@ -0,0 +1,88 @@
+/*
+ * mappedFile.h
+ *
+ *  Read only view of a whole file, memory mapped where the platform supports it.
+ */
+
+#ifndef SRC_MAPPEDFILE_H_
+#define SRC_MAPPEDFILE_H_
+
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPEDFILE_USE_MMAP 1
+#endif
+
+class MappedFile {
+	const char *data = nullptr;
+	size_t length = 0;
+	bool opened = false;
+	std::string fallback;	// file content if it can't be mapped
+
+public:
+	MappedFile(const std::string &filename) {
+#ifdef MAPPEDFILE_USE_MMAP
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if(fd >= 0) {
+			struct stat status;
+			if(::fstat(fd, &status) == 0) {
+				this->opened = true;
+				this->length = size_t(status.st_size);
+				if(this->length > 0) {
+					void *mapping = ::mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+					if(mapping != MAP_FAILED) {
+						::madvise(mapping, this->length, MADV_SEQUENTIAL);
+						this->data = static_cast<const char*>(mapping);
+					}
+				}
+			}
+			::close(fd);
+			if(this->data || !this->opened) {
+				return;
+			}
+		}
+#endif
+		std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
+		if(file.is_open()) {
+			this->fallback.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			this->data = this->fallback.data();
+			this->length = this->fallback.size();
+			this->opened = true;
+		}
+	};
+
+	~MappedFile() {
+#ifdef MAPPEDFILE_USE_MMAP
+		if(this->data && this->data != this->fallback.data()) {
+			::munmap(const_cast<char*>(this->data), this->length);
+		}
+#endif
+	};
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool isOpen() const {
+		return this->opened;
+	};
+
+	const char* begin() const {
+		return this->data;
+	};
+
+	const char* end() const {
+		return this->data + this->length;
+	};
+
+	size_t size() const {
+		return this->length;
+	};
+};
+
+#endif /* SRC_MAPPEDFILE_H_ */
@@ -8,13 +8,24 @@
 #ifndef SRC_READSCENE_H_
 #define SRC_READSCENE_H_
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <stack>
+#include <unordered_map>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <chrono>
+#include <omp.h>
 
+#include "mappedFile.h"
 #include "geometries.h"
+#include "container.h"
 #include "grid.h"
+#include "bvh.h"
+#include "lightCulling.h"
 
 #include <glm/glm.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
@@ -22,64 +33,383 @@
 #include <glm/gtx/string_cast.hpp>
 
 
+// splits one line of a scene file into whitespace separated tokens, without copying
+struct LineTokenizer {
+	const char *pos;
+	const char *end;
+
+	LineTokenizer(const char *begin, const char *end) : pos(begin), end(end) {}
+
+	static bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	std::string_view next() {
+		while(this->pos < this->end && isSpace(*this->pos)) {
+			this->pos++;
+		}
+		const char *start = this->pos;
+		while(this->pos < this->end && !isSpace(*this->pos)) {
+			this->pos++;
+		}
+		return std::string_view(start, this->pos - start);
+	}
+
+	// next token as number, 0 if it is missing or malformed like a failed stream extraction
+	template<typename T>
+	T number() {
+		std::string_view token = this->next();
+		if(!token.empty() && token[0] == '+') {
+			token.remove_prefix(1);
+		}
+		T value = 0;
+		if(std::from_chars(token.data(), token.data() + token.size(), value).ec != std::errc()) {
+			return 0;
+		}
+		return value;
+	}
+
+	glm::vec3 vec3() {
+		glm::vec3 v;
+		v.x = this->number<float>();
+		v.y = this->number<float>();
+		v.z = this->number<float>();
+		return v;
+	}
+};
+
+// acceleration structure that scene_content gets built as
+enum class AccelerationType {
+	CONTAINER,	// brute force
+	GRID,
+	BVH,
+};
+
+// camera of a keyframed path at time, frames in between are interpolated linearly
+struct CameraKeyframe {
+	float time;
+	Camera camera;
+};
+
 struct SceneReader {
 	Camera camera;
+	std::vector<Camera> cameras;			// every camera command, each one is rendered as a frame
+	std::vector<CameraKeyframe> keyframes;	// camera path sorted by time, replaces the camera commands
+	int frameCount = 0;						// frames along the keyframed path, one per keyframe if 0
 	std::vector<Light> lights;
+	LightCuller lightCuller;			// lights relevant to a fragment, built by the renderer
 	std::vector<glm::vec3> vertices;
+	std::vector<Material> materials;	// deduplicated, primitives reference these by index
 	std::vector<ITransformedIntersectable*> geometries;
 
-	// this is a member that points to either a PrimitiveGroup that gets brute force intersected 
-	// or a Grid structure
+	// this is a member that points to either a PrimitiveGroup that gets brute force intersected,
+	// a Grid or a BVH structure
 	std::unique_ptr<IIntersectable> scene_content;
+	AccelerationType accelerationType = AccelerationType::CONTAINER;	// what scene_content got built as
+
+	SceneUpdate pendingUpdate;	// geometry edits scene_content doesn't know of yet, see commitUpdates
 
 	std::string outputFilename = "";
 
+	std::vector<OccluderCache> occluderCaches;	// one per render thread, sized by the renderer
+
 	const float epsilonBias = 0.001f;
 
+	static const int maxDepthLimit = 32;
+	int maxDepth = 5;			// reflection bounces after the primary hit, maxdepth of the scene file
+	float minThroughput = 0;	// reflection paths with less specular throughput end, set by the renderer
+
+	// the views to render: frameCount (or this->frameCount) frames along the keyframed path,
+	// otherwise one per camera command. All of them get the resolution of camera
+	std::vector<Camera> frameCameras(int frameCount = 0) const {
+		std::vector<Camera> frames;
+		if(this->keyframes.empty()) {
+			frames = this->cameras.empty() ? std::vector<Camera>{ this->camera } : this->cameras;
+		}
+		else {
+			frameCount = frameCount > 0 ? frameCount : this->frameCount > 0 ? this->frameCount : int(this->keyframes.size());
+			const float start = this->keyframes.front().time;
+			const float end = this->keyframes.back().time;
+			size_t segment = 0;
+			for(int frame = 0; frame < frameCount; frame++) {
+				const float time = frameCount > 1 ? start + (end - start) * float(frame) / float(frameCount - 1) : start;
+				while(segment + 2 < this->keyframes.size() && this->keyframes[segment + 1].time <= time) {
+					segment++;
+				}
+				const CameraKeyframe &a = this->keyframes[segment];
+				const CameraKeyframe &b = this->keyframes[std::min(segment + 1, this->keyframes.size() - 1)];
+				const float s = b.time > a.time ? glm::clamp((time - a.time) / (b.time - a.time), 0.f, 1.f) : 0.f;
+
+				Camera camera = a.camera;
+				camera.eye = glm::mix(a.camera.eye, b.camera.eye, s);
+				camera.center = glm::mix(a.camera.center, b.camera.center, s);
+				camera.worldUp = glm::mix(a.camera.worldUp, b.camera.worldUp, s);
+				camera.fovDeg = glm::mix(a.camera.fovDeg, b.camera.fovDeg, s);
+				frames.push_back(camera);
+			}
+		}
+		for(auto &frame : frames) {
+			frame.width = this->camera.width;
+			frame.height = this->camera.height;
+			frame.updateAxes();
+		}
+		return frames;
+	};
+
 	~SceneReader()  {
 		for(auto const& geometry_prt : geometries) {
 			delete geometry_prt;
 		}
+		for(auto const& change : pendingUpdate.removed) {
+			delete change.geometry_ptr;
+		}
+	};
+
+	// moves a geometry of the scene by transform, applied in world space after its current transform
+	void moveGeometry(ITransformedIntersectable *geometry_ptr, glm::mat4 transform) {
+		auto &added = this->pendingUpdate.added;
+		auto &moved = this->pendingUpdate.moved;
+		if(std::find(added.begin(), added.end(), geometry_ptr) == added.end()
+				&& std::find_if(moved.begin(), moved.end(), [&](auto &change) { return change.geometry_ptr == geometry_ptr; }) == moved.end()) {
+			auto [bounds_min, bounds_max] = geometry_ptr->getBounds();
+			moved.push_back({geometry_ptr, bounds_min, bounds_max});
+		}
+		geometry_ptr->applyTransform(transform);
+	};
+
+	// adds a geometry to the scene, which takes ownership
+	void addGeometry(ITransformedIntersectable *geometry_ptr) {
+		this->geometries.push_back(geometry_ptr);
+		this->pendingUpdate.added.push_back(geometry_ptr);
 	};
 
-	void readScene(std::string filename, bool useGrid = false) {
+	// removes a geometry from the scene, it gets deleted once scene_content doesn't reference it anymore
+	void removeGeometry(ITransformedIntersectable *geometry_ptr) {
+		auto geometry = std::find(this->geometries.begin(), this->geometries.end(), geometry_ptr);
+		if(geometry == this->geometries.end()) {
+			return;
+		}
+		this->geometries.erase(geometry);
+
+		auto &added = this->pendingUpdate.added;
+		auto &moved = this->pendingUpdate.moved;
+		auto pending = std::find(added.begin(), added.end(), geometry_ptr);
+		if(pending != added.end()) {
+			added.erase(pending);
+			delete geometry_ptr;
+			return;
+		}
+
+		auto change = std::find_if(moved.begin(), moved.end(), [&](auto &change) { return change.geometry_ptr == geometry_ptr; });
+		if(change != moved.end()) {
+			this->pendingUpdate.removed.push_back(*change);	// with the bounds scene_content knows
+			moved.erase(change);
+		}
+		else {
+			auto [bounds_min, bounds_max] = geometry_ptr->getBounds();
+			this->pendingUpdate.removed.push_back({geometry_ptr, bounds_min, bounds_max});
+		}
+	};
+
+	// brings scene_content up to date with the geometry edits since the last call, at a cost that depends
+	// on the edited geometries only. Returns false if scene_content had to be rebuilt instead
+	bool commitUpdates() {
+		if(this->pendingUpdate.empty()) {
+			return true;
+		}
+
+		const bool updated = this->scene_content && this->scene_content->update(this->pendingUpdate);
+		if(!updated) {
+			this->buildAccelerationStructure(this->accelerationType);
+		}
+
+		if(!this->pendingUpdate.removed.empty()) {
+			// the occluder caches may still point to removed geometries
+			for(auto &occluderCache : this->occluderCaches) {
+				std::fill(occluderCache.lastOccluder.begin(), occluderCache.lastOccluder.end(), PrimitiveRef{nullptr, 0});
+			}
+			for(auto const& change : this->pendingUpdate.removed) {
+				delete change.geometry_ptr;
+			}
+		}
+		this->pendingUpdate = SceneUpdate();
+		return updated;
+	};
+
+	static const char* findLineEnd(const char *line, const char *end) {
+		if(line >= end) {
+			return end;
+		}
+		const char *newline = static_cast<const char*>(std::memchr(line, '\n', end - line));
+		return newline ? newline : end;
+	}
+
+	// lines that can be part of a vertex/tri block: these two commands, empty lines and comments
+	static bool isGeometryLine(std::string_view cmd) {
+		return cmd == "vertex" || cmd == "tri" || cmd.empty() || cmd[0] == '#';
+	}
+
+	// parses the lines [begin, end) of a vertex/tri block. Large blocks are split into chunks at line
+	// boundaries that get parsed in parallel. Vertices are appended to the scene vertices, the vertex
+	// indices of the tri commands to triangles, both in file order.
+	void parseGeometryRun(const char *begin, const char *end, std::vector<glm::ivec3> &triangles) {
+		const size_t chunkBytes = 1 << 18;
+		const int chunkCount = int(std::min<size_t>((end - begin) / chunkBytes + 1, 4 * omp_get_max_threads()));
+
+		std::vector<const char*> bounds(chunkCount + 1, end);
+		bounds[0] = begin;
+		for(int i = 1; i < chunkCount; i++) {
+			const char *split = std::max(bounds[i - 1], begin + (end - begin) * i / chunkCount);
+			bounds[i] = std::min(findLineEnd(split, end) + 1, end);
+		}
+
+		std::vector<std::vector<glm::vec3>> chunkVertices(chunkCount);
+		std::vector<std::vector<glm::ivec3>> chunkTriangles(chunkCount);
+
+		#pragma omp parallel for schedule(dynamic) if(chunkCount > 1)
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			for(const char *line = bounds[chunk]; line < bounds[chunk + 1]; ) {
+				const char *lineEnd = findLineEnd(line, bounds[chunk + 1]);
+				LineTokenizer linestream(line, lineEnd);
+				std::string_view cmd = linestream.next();
+				if(cmd == "vertex") {
+					chunkVertices[chunk].push_back(linestream.vec3());
+				}
+				else if(cmd == "tri") {
+					glm::ivec3 triangle;
+					triangle.x = linestream.number<int>();
+					triangle.y = linestream.number<int>();
+					triangle.z = linestream.number<int>();
+					chunkTriangles[chunk].push_back(triangle);
+				}
+				line = lineEnd + 1;
+			}
+		}
+
+		for(int chunk = 0; chunk < chunkCount; chunk++) {
+			this->vertices.insert(this->vertices.end(), chunkVertices[chunk].begin(), chunkVertices[chunk].end());
+			triangles.insert(triangles.end(), chunkTriangles[chunk].begin(), chunkTriangles[chunk].end());
+		}
+	}
+
+	// returns index of material in the material table, adds it if there is no equal one yet
+	int internMaterial(const Material &material) {
+		for(int i = int(materials.size()) - 1; i >= 0; i--) {
+			if(materials[i] == material) {
+				return i;
+			}
+		}
+		materials.push_back(material);
+		return int(materials.size()) - 1;
+	};
+
+	void readScene(std::string filename, AccelerationType accelerationType = AccelerationType::CONTAINER) {
         glm::vec3 cur_diffuseColor(1, 1, 1);
         glm::vec3 cur_ambientColor(0, 0, 0);
         glm::vec3 cur_specularColor(0, 0, 0);
         glm::vec3 cur_emissionColor(0, 0, 0);
         glm::vec3 cur_attenuationTerms(1, 0, 0);
         float cur_shininessValue = 40;
+        int cur_materialIndex = -1;	// interned lazily on the next primitive, -1 after material changes
+        auto currentMaterialIndex = [&]() {
+        	if(cur_materialIndex < 0) {
+        		cur_materialIndex = this->internMaterial(
+        				Material(cur_ambientColor, cur_diffuseColor, cur_specularColor, cur_emissionColor, cur_shininessValue));
+        	}
+        	return cur_materialIndex;
+        };
 
 		std::stack<glm::mat4> transformStack;
 		transformStack.push(glm::mat4(1.f));	// last unpoppable entry = identity matrix
 
-		std::ifstream file(filename.c_str());
-		if (!file.is_open()) {
+		// consecutive tri commands with unchanged material and transform go into the same mesh
+		TriangleMesh *cur_mesh = nullptr;
+		std::unordered_map<int, int> cur_meshVertexIndices;	// scene vertex index -> mesh vertex index
+
+		// adds a tri command's triangle to the current mesh
+		auto addTriangle = [&](int indexA, int indexB, int indexC) {
+			int materialIndex = currentMaterialIndex();
+			if(!cur_mesh || cur_mesh->materialIndex != materialIndex || cur_mesh->getSourceTransform() != transformStack.top()) {
+				cur_mesh = new TriangleMesh(materialIndex, glm::mat4(transformStack.top()));
+				cur_meshVertexIndices.clear();
+				geometries.push_back(cur_mesh);
+			}
+
+			// scene vertices get copied into the mesh vertex buffer once, on first use
+			auto meshVertexIndex = [&](int index) {
+				auto [it, inserted] = cur_meshVertexIndices.try_emplace(index, 0);
+				if(inserted) {
+					it->second = cur_mesh->addVertex(vertices[index]);
+				}
+				return it->second;
+			};
+			cur_mesh->addTriangle(meshVertexIndex(indexA), meshVertexIndex(indexB), meshVertexIndex(indexC));
+		};
+
+		MappedFile file(filename);
+		if (!file.isOpen()) {
 			std::cout << "file could not be read: " << filename << std::endl;
+			return;
 		}
 
 		std::cout << "reading in " << filename << ": " << std::endl;
 
-		for(std::string line; getline(file, line);) {
-			std::stringstream linestream(line);
-			std::string cmd;
+		const char *end = file.end();
+		for(const char *line = file.begin(); line < end; ) {
+			const char *lineEnd = findLineEnd(line, end);
+			LineTokenizer linestream(line, lineEnd);
+			std::string_view cmd = linestream.next();
+
+			if(cmd == "vertex" || cmd == "tri") {
+				// vertex and tri blocks don't change any state, they are parsed as a whole
+				const char *runEnd = lineEnd;
+				while(runEnd < end) {
+					const char *nextEnd = findLineEnd(runEnd + 1, end);
+					if(!isGeometryLine(LineTokenizer(runEnd + 1, nextEnd).next())) {
+						break;
+					}
+					runEnd = nextEnd;
+				}
 
-			linestream >> cmd;
+				std::vector<glm::ivec3> triangles;
+				this->parseGeometryRun(line, runEnd, triangles);
+				for(auto const& triangle : triangles) {
+					addTriangle(triangle.x, triangle.y, triangle.z);
+				}
 
-			if(cmd == "size") {
-				linestream >> camera.width >> camera.height;
+				line = runEnd + 1;
+				continue;
+			}
+			else if(cmd == "size") {
+				camera.width = linestream.number<int>();
+				camera.height = linestream.number<int>();
 
 			}
 			else if(cmd == "camera") {
-				linestream >> camera.eye[0] >> camera.eye[1] >> camera.eye[2]
-						   >> camera.center[0] >> camera.center[1] >> camera.center[2]
-                           >> camera.worldUp[0] >> camera.worldUp[1] >> camera.worldUp[2]
-						   >> camera.fovDeg;
+				camera.eye = linestream.vec3();
+				camera.center = linestream.vec3();
+				camera.worldUp = linestream.vec3();
+				camera.fovDeg = linestream.number<float>();
+				cameras.push_back(camera);
+			}
+			else if(cmd == "keyframe") {
+				CameraKeyframe keyframe;
+				keyframe.time = linestream.number<float>();
+				keyframe.camera.eye = linestream.vec3();
+				keyframe.camera.center = linestream.vec3();
+				keyframe.camera.worldUp = linestream.vec3();
+				keyframe.camera.fovDeg = linestream.number<float>();
+				auto position = std::upper_bound(keyframes.begin(), keyframes.end(), keyframe.time,
+						[](float time, const CameraKeyframe &other) { return time < other.time; });
+				keyframes.insert(position, keyframe);
+			}
+			else if(cmd == "frames") {
+				frameCount = std::max(linestream.number<int>(), 0);
 			}
 			else if(cmd == "point" || cmd == "directional") {
 				Light light;
-				linestream >> light.position[0] >> light.position[1]>> light.position[2]
-                           >> light.color[0] >> light.color[1]>> light.color[2];
+				light.position = linestream.vec3();
+				light.color = linestream.vec3();
 				if(cmd == "point") {
 					light.type = LightType::POINT;
 					light.attenuation = cur_attenuationTerms;
@@ -94,52 +424,37 @@ struct SceneReader {
 
 				lights.push_back(light);
 			}
-			else if(cmd == "vertex") {
-				glm::vec3 vertex;
-				linestream >> vertex[0] >> vertex[1] >> vertex[2];
-
-
-				vertices.push_back(vertex);
-			}
-			else if(cmd == "tri") {
-				int indexA, indexB, indexC;
-				linestream >> indexA >> indexB >> indexC;
-
-				Triangle *triangle = new Triangle(vertices[indexA], vertices[indexB], vertices[indexC],
-						Material(cur_ambientColor, cur_diffuseColor, cur_specularColor, cur_emissionColor, cur_shininessValue),
-						glm::mat4(transformStack.top()));
-
-				geometries.push_back(triangle);
-			}
 			else if(cmd == "sphere") {
-				glm::vec3 center;
-				float radius;
-				linestream >> center[0] >> center[1]>> center[2] >> radius;
-				Sphere *sphere = new Sphere(center, radius,
-						Material(cur_ambientColor, cur_diffuseColor, cur_specularColor, cur_emissionColor, cur_shininessValue),
-                        glm::mat4(transformStack.top()));
+				glm::vec3 center = linestream.vec3();
+				float radius = linestream.number<float>();
+				Sphere *sphere = new Sphere(center, radius, currentMaterialIndex(), glm::mat4(transformStack.top()));
 
 				geometries.push_back(sphere);
 			}
 			else if(cmd == "ambient") {
-				linestream >> cur_ambientColor[0] >> cur_ambientColor[1] >> cur_ambientColor[2];
+				cur_ambientColor = linestream.vec3();
+				cur_materialIndex = -1;
 			}
 			else if(cmd == "specular") {
-				linestream >> cur_specularColor[0] >> cur_specularColor[1] >> cur_specularColor[2];
+				cur_specularColor = linestream.vec3();
+				cur_materialIndex = -1;
 
 			}
 			else if(cmd == "diffuse") {
-				linestream >> cur_diffuseColor[0] >> cur_diffuseColor[1] >> cur_diffuseColor[2];
+				cur_diffuseColor = linestream.vec3();
+				cur_materialIndex = -1;
 			}
 			else if(cmd == "emission") {
-				linestream >> cur_emissionColor[0] >> cur_emissionColor[1] >> cur_emissionColor[2];
+				cur_emissionColor = linestream.vec3();
+				cur_materialIndex = -1;
 			}
 			else if(cmd == "shininess") {
-				linestream >> cur_shininessValue;
+				cur_shininessValue = linestream.number<float>();
+				cur_materialIndex = -1;
 				std::cout << "shininess: " << cur_shininessValue << std::endl;
 			}
 			else if(cmd == "attenuation" ) {
-				linestream >> cur_attenuationTerms[0] >> cur_attenuationTerms[1] >> cur_attenuationTerms[2];
+				cur_attenuationTerms = linestream.vec3();
 				std::cout << "attenuation: " << glm::to_string(cur_attenuationTerms)<< std::endl;
 			}
 			else if(cmd == "pushTransform") {
@@ -151,34 +466,47 @@ struct SceneReader {
 				}
 			}
 			else if(cmd == "translate") {
-				glm::vec3 translationVector;
-				linestream >> translationVector[0] >> translationVector[1] >> translationVector[2];
+				glm::vec3 translationVector = linestream.vec3();
 				transformStack.top() = glm::translate(transformStack.top(), translationVector);
 			}
 			else if(cmd == "rotate") {
-				glm::vec3 rotationAxis;
-				float degrees;
-				linestream >> rotationAxis[0] >> rotationAxis[1] >> rotationAxis[2] >> degrees;
+				glm::vec3 rotationAxis = linestream.vec3();
+				float degrees = linestream.number<float>();
 				transformStack.top() *= glm::rotate(degrees*glm::pi<float>()/180.f, rotationAxis);
 			}
 			else if(cmd == "scale") {
-				glm::vec3 scaleVector;
-				linestream >> scaleVector[0] >> scaleVector[1] >> scaleVector[2];
+				glm::vec3 scaleVector = linestream.vec3();
 				transformStack.top() *= glm::scale(scaleVector);
 			}
+			else if(cmd == "maxdepth") {
+				maxDepth = glm::clamp(linestream.number<int>(), 0, maxDepthLimit);
+			}
 			else if(cmd == "output") {
-				linestream >> outputFilename;
+				outputFilename = std::string(linestream.next());
 			}
 //			on (cmd[0] == '#'|| cmd.empty()) do nothing
 //			ignore unrecognized commands
+
+			line = lineEnd + 1;
 		}
 
-		if(useGrid) {
+		this->buildAccelerationStructure(accelerationType);
+	}
+
+	void buildAccelerationStructure(AccelerationType accelerationType) {
+		this->accelerationType = accelerationType;
+		auto start = std::chrono::high_resolution_clock::now();
+		if(accelerationType == AccelerationType::GRID) {
 			this->scene_content = std::make_unique<Grid>(&geometries);
 		}
+		else if(accelerationType == AccelerationType::BVH) {
+			this->scene_content = std::make_unique<BVH>(&geometries);
+		}
 		else {
 			this->scene_content = std::make_unique<Container>(&geometries);
 		}
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "built acceleration structure after " << elapsed.count() << " seconds" << std::endl;
 	}
 };
 
@@ -0,0 +1,490 @@
+/*
+ * sceneCache.h
+ *
+ *  Binary snapshot of a parsed scene and its BVH, repeated runs load it instead of parsing and building.
+ */
+
+#ifndef SRC_SCENECACHE_H_
+#define SRC_SCENECACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "mappedFile.h"
+#include "readScene.h"
+
+// The cache file sits next to the scene (scene.test.rtcache). It starts with a Header that keys it on the
+// source file, followed by sections without any pointers: every array is a uint64 element count and the
+// raw elements, both 8 byte aligned. Primitives are stored as (geometry index, primID).
+class SceneCache {
+public:
+	static const std::uint32_t version = 3;
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t simdWidth;
+		std::uint32_t layoutSizes[6];	// sizes of the stored structs, catches layout changes without version bump
+		std::uint64_t sourceSize;
+		std::uint64_t sourceHash;
+		std::int64_t sourceMtime;
+	};
+
+private:
+	enum GeometryType : std::int32_t {
+		SPHERE,
+		TRIANGLE,
+		TRIANGLE_MESH,
+	};
+
+	struct GeometryRecord {
+		std::int32_t type;
+		std::int32_t materialIndex;
+		glm::mat4 transform;	// as set on the geometry, identity if baked. Meshes store their source transform
+		glm::vec3 points[3];	// sphere center or triangle vertices
+		float radius;
+		std::uint64_t firstVertex, vertexCount;		// mesh ranges in the shared vertex and index arrays
+		std::uint64_t firstTriangle, triangleCount;
+	};
+
+	struct PrimitiveRecord {
+		std::int32_t geometryIndex;		// -1 for unused batch lanes
+		std::int32_t primID;
+	};
+
+	class Writer {
+		std::vector<char> buffer;
+	public:
+		template<typename T>
+		void value(const T &v) {
+			static_assert(std::is_trivially_copyable_v<T>, "cache stores raw bytes");
+			const char *bytes = reinterpret_cast<const char*>(&v);
+			this->buffer.insert(this->buffer.end(), bytes, bytes + sizeof(T));
+		}
+
+		void align() {
+			this->buffer.resize((this->buffer.size() + 7) & ~size_t(7), 0);
+		}
+
+		template<typename T>
+		void array(const T *data, size_t count) {
+			static_assert(std::is_trivially_copyable_v<T>, "cache stores raw bytes");
+			this->align();
+			this->value(std::uint64_t(count));
+			const char *bytes = reinterpret_cast<const char*>(data);
+			this->buffer.insert(this->buffer.end(), bytes, bytes + count * sizeof(T));
+		}
+
+		template<typename T>
+		void array(const std::vector<T> &data) {
+			this->array(data.data(), data.size());
+		}
+
+		void string(const std::string &s) {
+			this->array(s.data(), s.size());
+		}
+
+		// written to a temporary file first, so concurrent runs never see a half written cache
+		bool save(const std::string &filename) {
+			// unique per process and writer, so concurrent writers never share a temporary file
+			static std::atomic<unsigned> writerCount = 0;
+			const std::string tmpFilename = filename + "." + std::to_string(getpid()) + "." + std::to_string(writerCount++) + ".tmp";
+			std::error_code error;
+			{
+				std::ofstream file(tmpFilename, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+				if(!file.write(this->buffer.data(), this->buffer.size())) {
+					file.close();
+					std::filesystem::remove(tmpFilename, error);
+					return false;
+				}
+			}
+			std::filesystem::rename(tmpFilename, filename, error);
+			if(error) {
+				std::filesystem::remove(tmpFilename, error);
+				return false;
+			}
+			return true;
+		}
+	};
+
+	class Reader {
+		const char *begin;
+		const char *pos;
+		const char *end;
+	public:
+		bool ok = true;		// false after reading past the end
+
+		Reader(const char *begin, const char *end) : begin(begin), pos(begin), end(end) {}
+
+		template<typename T>
+		bool value(T &v) {
+			if(!this->ok || size_t(this->end - this->pos) < sizeof(T)) {
+				return this->ok = false;
+			}
+			std::memcpy(&v, this->pos, sizeof(T));
+			this->pos += sizeof(T);
+			return true;
+		}
+
+		void align() {
+			size_t offset = (size_t(this->pos - this->begin) + 7) & ~size_t(7);
+			this->pos = this->begin + std::min(offset, size_t(this->end - this->begin));
+		}
+
+		template<typename T>
+		bool array(std::vector<T> &data) {
+			this->align();
+			std::uint64_t count;
+			if(!this->value(count) || count > size_t(this->end - this->pos) / sizeof(T)) {
+				return this->ok = false;
+			}
+			data.resize(count);
+			std::memcpy(static_cast<void*>(data.data()), this->pos, count * sizeof(T));
+			this->pos += count * sizeof(T);
+			return true;
+		}
+
+		bool string(std::string &s) {
+			std::vector<char> chars;
+			if(!this->array(chars)) {
+				return false;
+			}
+			s.assign(chars.begin(), chars.end());
+			return true;
+		}
+	};
+
+	// FNV-1a
+	static std::uint64_t hash(const char *begin, const char *end) {
+		std::uint64_t h = 14695981039346656037ull;
+		for(const char *c = begin; c < end; c++) {
+			h = (h ^ std::uint8_t(*c)) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	// header the cache of filename has to match, false if the scene file can't be read
+	static bool currentHeader(const std::string &filename, Header &header) {
+		MappedFile source(filename);
+		std::error_code error;
+		auto mtime = std::filesystem::last_write_time(filename, error);
+		if(!source.isOpen() || error) {
+			return false;
+		}
+
+		header = Header();
+		std::memcpy(header.magic, "RTSCENE", 8);
+		header.version = version;
+		header.simdWidth = SIMD_WIDTH;
+		header.layoutSizes[0] = sizeof(GeometryRecord);
+		header.layoutSizes[1] = sizeof(BVHNode);
+		header.layoutSizes[2] = sizeof(TriangleBatch);
+		header.layoutSizes[3] = sizeof(SphereBatch);
+		header.layoutSizes[4] = sizeof(Camera);
+		header.layoutSizes[5] = sizeof(Light);
+		header.sourceSize = source.size();
+		header.sourceHash = hash(source.begin(), source.end());
+		header.sourceMtime = std::int64_t(mtime.time_since_epoch().count());
+		return true;
+	}
+
+	template<typename Batch>
+	static void writeBatches(Writer &writer, const std::vector<Batch> &batches,
+			const std::unordered_map<ITransformedIntersectable*, int> &geometryIndices) {
+		std::vector<PrimitiveRecord> records;
+		for(auto const& batch : batches) {
+			for(int lane = 0; lane < SIMD_WIDTH; lane++) {
+				const PrimitiveRef &primitive = batch.primitives[lane];
+				records.push_back({primitive.geometry_ptr ? geometryIndices.at(primitive.geometry_ptr) : -1, primitive.primID});
+			}
+		}
+		writer.array(batches);		// primitive pointers in there are meaningless, they get patched on load
+		writer.array(records);
+	}
+
+	static bool validPrimID(ITransformedIntersectable *geometry_ptr, int primID) {
+		return primID >= 0 && primID < geometry_ptr->getPrimitiveCount();
+	}
+
+	// nodes have to form one tree in depth first order, no deeper than the traversal stacks, whose leaves
+	// only reference existing primitives and batches
+	static bool validNodes(const BVH &bvh) {
+		const int nodeCount = int(bvh.nodes.size());
+		if(bvh.primitives.empty()) {
+			// the single empty leaf, never entered because its bounds are inverted
+			return nodeCount == 1 && bvh.nodes[0].count == 0
+					&& bvh.nodes[0].bounds_min == glm::vec3(1, 1, 1) * FLOAT_MAX && bvh.nodes[0].bounds_max == glm::vec3(1, 1, 1) * -FLOAT_MAX;
+		}
+		std::vector<int> depths(nodeCount, 0), parentCounts(nodeCount, 0);
+		for(int node_index = 0; node_index < nodeCount; node_index++) {
+			const BVHNode &node = bvh.nodes[node_index];
+			if(node_index > 0 && parentCounts[node_index] != 1) {
+				return false;
+			}
+			if(node.count > 0) {
+				if(node.offset < 0 || node.count > int(bvh.primitives.size()) - node.offset
+						|| node.scalarOffset < node.offset || node.scalarOffset > node.offset + node.count
+						|| node.triangleBatch < -1 || node.triangleBatch >= int(bvh.triangleBatches.size())
+						|| node.sphereBatch < -1 || node.sphereBatch >= int(bvh.sphereBatches.size())) {
+					return false;
+				}
+				continue;
+			}
+			if(node.count < 0 || node.axis < 0 || node.axis > 2 || depths[node_index] >= BVH::maxTreeDepth
+					|| node.offset <= node_index + 1 || node.offset >= nodeCount) {
+				return false;
+			}
+			for(int child : { node_index + 1, node.offset }) {
+				depths[child] = depths[node_index] + 1;
+				parentCounts[child]++;
+			}
+		}
+		return true;
+	}
+
+	template<typename Batch>
+	static bool readBatches(Reader &reader, std::vector<Batch> &batches, const std::vector<ITransformedIntersectable*> &geometries) {
+		std::vector<PrimitiveRecord> records;
+		if(!reader.array(batches) || !reader.array(records) || records.size() != batches.size() * SIMD_WIDTH) {
+			return false;
+		}
+		for(size_t i = 0; i < batches.size(); i++) {
+			for(int lane = 0; lane < SIMD_WIDTH; lane++) {
+				const PrimitiveRecord &record = records[i * SIMD_WIDTH + lane];
+				if(record.geometryIndex < -1 || record.geometryIndex >= int(geometries.size())
+						|| (record.geometryIndex >= 0 && !validPrimID(geometries[record.geometryIndex], record.primID))) {
+					return false;
+				}
+				batches[i].primitives[lane] = {record.geometryIndex < 0 ? nullptr : geometries[record.geometryIndex], record.primID};
+			}
+		}
+		return true;
+	}
+
+	// deletes what a failed load created already
+	static bool discard(SceneReader &sr) {
+		for(auto const& geometry_ptr : sr.geometries) {
+			delete geometry_ptr;
+		}
+		sr.geometries.clear();
+		sr.lights.clear();
+		sr.materials.clear();
+		sr.outputFilename.clear();
+		sr.camera = Camera();
+		sr.cameras.clear();
+		sr.keyframes.clear();
+		sr.frameCount = 0;
+		sr.maxDepth = 5;
+		sr.scene_content.reset();
+		return false;
+	}
+
+public:
+	static std::string cacheFilename(const std::string &sceneFilename) {
+		return sceneFilename + ".rtcache";
+	}
+
+	// writes the parsed scene sr of sceneFilename with its BVH, which gets built if sr uses another structure
+	static bool save(SceneReader &sr, const std::string &sceneFilename) {
+		Header header;
+		if(!currentHeader(sceneFilename, header)) {
+			return false;
+		}
+
+		Writer writer;
+		writer.value(header);
+		writer.value(sr.camera);
+		writer.array(sr.cameras);
+		writer.array(sr.keyframes);
+		writer.value(sr.frameCount);
+		writer.value(sr.maxDepth);
+		writer.array(sr.lights);
+		writer.array(sr.materials);
+		writer.string(sr.outputFilename);
+
+		std::unordered_map<ITransformedIntersectable*, int> geometryIndices;
+		std::vector<GeometryRecord> records;
+		std::vector<glm::vec3> meshVertices;
+		std::vector<glm::ivec3> meshIndices;
+		for(auto const& geometry_ptr : sr.geometries) {
+			geometryIndices[geometry_ptr] = int(records.size());
+
+			GeometryRecord record = {};
+			record.materialIndex = geometry_ptr->materialIndex;
+			record.transform = geometry_ptr->transform;
+			if(auto sphere = dynamic_cast<Sphere*>(geometry_ptr)) {
+				record.type = SPHERE;
+				record.points[0] = sphere->center;
+				record.radius = sphere->radius;
+			}
+			else if(auto triangle = dynamic_cast<Triangle*>(geometry_ptr)) {
+				record.type = TRIANGLE;
+				record.points[0] = triangle->A;
+				record.points[1] = triangle->B;
+				record.points[2] = triangle->C;
+			}
+			else if(auto mesh = dynamic_cast<TriangleMesh*>(geometry_ptr)) {
+				record.type = TRIANGLE_MESH;
+				// vertices are stored baked, a transform that is left (moved by a projective one) gets restored as is
+				record.transform = mesh->hasTransform ? mesh->transform : mesh->sourceTransform;
+				record.firstVertex = meshVertices.size();
+				record.vertexCount = mesh->vertices.size();
+				record.firstTriangle = meshIndices.size();
+				record.triangleCount = mesh->indices.size();
+				meshVertices.insert(meshVertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+				meshIndices.insert(meshIndices.end(), mesh->indices.begin(), mesh->indices.end());
+			}
+			else {
+				return false;	// unknown geometry type
+			}
+			records.push_back(record);
+		}
+		writer.array(records);
+		writer.array(meshVertices);
+		writer.array(meshIndices);
+
+		std::unique_ptr<BVH> ownBVH;
+		BVH *bvh = dynamic_cast<BVH*>(sr.scene_content.get());
+		if(!bvh) {
+			ownBVH = std::make_unique<BVH>(&sr.geometries);
+			bvh = ownBVH.get();
+		}
+		std::vector<PrimitiveRecord> primitives;
+		for(auto const& primitive : bvh->primitives) {
+			primitives.push_back({geometryIndices.at(primitive.geometry_ptr), primitive.primID});
+		}
+		writer.array(bvh->nodes);
+		writer.array(primitives);
+		writeBatches(writer, bvh->triangleBatches, geometryIndices);
+		writeBatches(writer, bvh->sphereBatches, geometryIndices);
+
+		return writer.save(cacheFilename(sceneFilename));
+	}
+
+	// fills an empty sr from the cache of sceneFilename. False if there is no cache or it is outdated,
+	// sr stays empty then
+	static bool load(SceneReader &sr, const std::string &sceneFilename, AccelerationType accelerationType) {
+		MappedFile file(cacheFilename(sceneFilename));
+		Header expected, header;
+		if(!file.isOpen() || !currentHeader(sceneFilename, expected)) {
+			return false;
+		}
+
+		Reader reader(file.begin(), file.end());
+		if(!reader.value(header) || std::memcmp(&header, &expected, sizeof(Header)) != 0) {
+			return false;
+		}
+
+		std::vector<GeometryRecord> records;
+		std::vector<glm::vec3> meshVertices;
+		std::vector<glm::ivec3> meshIndices;
+		reader.value(sr.camera);
+		reader.array(sr.cameras);
+		reader.array(sr.keyframes);
+		reader.value(sr.frameCount);
+		reader.value(sr.maxDepth);
+		reader.array(sr.lights);
+		reader.array(sr.materials);
+		reader.string(sr.outputFilename);
+		reader.array(records);
+		reader.array(meshVertices);
+		reader.array(meshIndices);
+		if(!reader.ok) {
+			return discard(sr);
+		}
+
+		for(auto const& record : records) {
+			if(record.materialIndex < 0 || record.materialIndex >= int(sr.materials.size())) {
+				return discard(sr);
+			}
+
+			// constructed untransformed, then the stored (already baked) state is restored as is
+			if(record.type == SPHERE) {
+				Sphere *sphere = new Sphere(record.points[0], record.radius, record.materialIndex, glm::mat4(1.f));
+				sphere->center = record.points[0];
+				sphere->radius = record.radius;
+				sphere->setTransform(record.transform);
+				sr.geometries.push_back(sphere);
+			}
+			else if(record.type == TRIANGLE) {
+				Triangle *triangle = new Triangle(record.points[0], record.points[1], record.points[2], record.materialIndex, glm::mat4(1.f));
+				triangle->A = record.points[0];
+				triangle->B = record.points[1];
+				triangle->C = record.points[2];
+				triangle->setTransform(record.transform);
+				sr.geometries.push_back(triangle);
+			}
+			else if(record.type == TRIANGLE_MESH
+					&& record.vertexCount <= meshVertices.size() && record.firstVertex <= meshVertices.size() - record.vertexCount
+					&& record.triangleCount <= meshIndices.size() && record.firstTriangle <= meshIndices.size() - record.triangleCount) {
+				TriangleMesh *mesh = new TriangleMesh(record.materialIndex, record.transform);
+				mesh->vertices.assign(meshVertices.begin() + record.firstVertex, meshVertices.begin() + record.firstVertex + record.vertexCount);
+				mesh->indices.assign(meshIndices.begin() + record.firstTriangle, meshIndices.begin() + record.firstTriangle + record.triangleCount);
+				sr.geometries.push_back(mesh);
+				for(auto const& triangle : mesh->indices) {
+					for(int corner = 0; corner < 3; corner++) {
+						if(triangle[corner] < 0 || std::uint64_t(triangle[corner]) >= record.vertexCount) {
+							return discard(sr);
+						}
+					}
+				}
+			}
+			else {
+				return discard(sr);
+			}
+		}
+
+		if(accelerationType == AccelerationType::BVH) {
+			std::unique_ptr<BVH> bvh(new BVH());
+			std::vector<PrimitiveRecord> primitives;
+			if(!reader.array(bvh->nodes) || bvh->nodes.empty() || !reader.array(primitives)
+					|| !readBatches(reader, bvh->triangleBatches, sr.geometries)
+					|| !readBatches(reader, bvh->sphereBatches, sr.geometries)) {
+				return discard(sr);
+			}
+			for(auto const& record : primitives) {
+				if(record.geometryIndex < 0 || record.geometryIndex >= int(sr.geometries.size())
+						|| !validPrimID(sr.geometries[record.geometryIndex], record.primID)) {
+					return discard(sr);
+				}
+				bvh->primitives.push_back({sr.geometries[record.geometryIndex], record.primID});
+			}
+			if(!validNodes(*bvh)) {
+				return discard(sr);
+			}
+			sr.scene_content = std::move(bvh);
+			sr.accelerationType = accelerationType;
+		}
+		else {
+			sr.buildAccelerationStructure(accelerationType);
+		}
+		return true;
+	}
+};
+
+// reads a scene from its cache if that is up to date, otherwise parses the scene and writes the cache
+inline void loadScene(SceneReader &sr, const std::string &filename, AccelerationType accelerationType, bool useCache = true) {
+	if(useCache && SceneCache::load(sr, filename, accelerationType)) {
+		std::cout << "loaded " << SceneCache::cacheFilename(filename) << std::endl;
+		return;
+	}
+
+	sr.readScene(filename, accelerationType);
+	if(useCache && sr.scene_content && !SceneCache::save(sr, filename)) {
+		std::cout << "could not write scene cache " << SceneCache::cacheFilename(filename) << std::endl;
+	}
+}
+
+#endif /* SRC_SCENECACHE_H_ */
@@ -0,0 +1,184 @@
+/*
+ * scheduler.h
+ *
+ *  Splits the image into tiles and renders them with a work stealing thread pool.
+ */
+
+#ifndef SRC_SCHEDULER_H_
+#define SRC_SCHEDULER_H_
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// pixel rectangle [x0, x1) x [y0, y1)
+struct Tile {
+	int x0, y0, x1, y1;
+};
+
+// Tiles are sorted along a Morton curve and every thread gets a contiguous run of them, so neighbouring
+// tiles (and their geometry) are rendered by the same thread. A thread that runs out of tiles steals
+// from the back of another thread's queue, which is the part of the image farthest from the victim's.
+class TileScheduler {
+	// tile queue of one thread, the owner pops from the front, thieves from the back
+	struct alignas(64) WorkQueue {
+		std::mutex lock;
+		std::deque<int> tiles;
+	};
+
+	// per thread statistics
+	struct alignas(64) WorkerStats {
+		double busySeconds = 0;
+		int tilesRendered = 0;
+		int tilesStolen = 0;
+	};
+
+	std::vector<Tile> tiles;
+	std::vector<WorkQueue> queues;
+	std::vector<WorkerStats> stats;
+	int threadCount;
+	double wallSeconds = 0;
+
+	// interleaves the bits of x and y
+	static std::uint32_t mortonCode(std::uint32_t x, std::uint32_t y) {
+		auto spread = [](std::uint32_t v) {
+			v &= 0xffff;
+			v = (v | (v << 8)) & 0x00ff00ff;
+			v = (v | (v << 4)) & 0x0f0f0f0f;
+			v = (v | (v << 2)) & 0x33333333;
+			v = (v | (v << 1)) & 0x55555555;
+			return v;
+		};
+		return spread(x) | (spread(y) << 1);
+	}
+
+	bool popOwn(int thread, int &tile) {
+		WorkQueue &queue = this->queues[thread];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if(queue.tiles.empty()) {
+			return false;
+		}
+		tile = queue.tiles.front();
+		queue.tiles.pop_front();
+		return true;
+	}
+
+	// tries all other queues once, starting at the next thread. No new tiles are ever pushed,
+	// so failing on all of them means the frame is done
+	bool steal(int thread, int &tile) {
+		for(int i = 1; i < this->threadCount; i++) {
+			WorkQueue &queue = this->queues[(thread + i) % this->threadCount];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if(!queue.tiles.empty()) {
+				tile = queue.tiles.back();
+				queue.tiles.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	// threadCount <= 0 uses all available threads
+	TileScheduler(int width, int height, int tileSize, int threadCount = 0)
+		: queues(threadCount > 0 ? threadCount : omp_get_max_threads()),
+		  stats(queues.size()),
+		  threadCount(int(queues.size())) {
+		tileSize = std::max(tileSize, 1);
+		const int tilesX = (width + tileSize - 1) / tileSize;
+		const int tilesY = (height + tileSize - 1) / tileSize;
+
+		std::vector<std::pair<std::uint32_t, Tile>> ordered;
+		for(int ty = 0; ty < tilesY; ty++) {
+			for(int tx = 0; tx < tilesX; tx++) {
+				Tile tile = { tx * tileSize, ty * tileSize,
+						std::min((tx + 1) * tileSize, width), std::min((ty + 1) * tileSize, height) };
+				ordered.push_back({mortonCode(tx, ty), tile});
+			}
+		}
+		std::sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+		for(auto const& entry : ordered) {
+			this->tiles.push_back(entry.second);
+		}
+	};
+
+	int getThreadCount() const {
+		return this->threadCount;
+	};
+
+	const std::vector<Tile>& getTiles() const {
+		return this->tiles;
+	};
+
+	// renders all tiles, renderTile(const Tile&) gets called concurrently from the worker threads.
+	// omp_get_thread_num() inside renderTile is the worker index in [0, getThreadCount())
+	template<typename TileRenderer>
+	void run(TileRenderer renderTile) {
+		const int tileCount = int(this->tiles.size());
+		for(int thread = 0; thread < this->threadCount; thread++) {
+			this->queues[thread].tiles.clear();
+			for(int i = tileCount * thread / this->threadCount; i < tileCount * (thread + 1) / this->threadCount; i++) {
+				this->queues[thread].tiles.push_back(i);
+			}
+			this->stats[thread] = WorkerStats();
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		#pragma omp parallel num_threads(this->threadCount)
+		{
+			const int thread = omp_get_thread_num();
+			WorkerStats &workerStats = this->stats[thread];
+
+			int tile;
+			while(true) {
+				if(!this->popOwn(thread, tile)) {
+					if(!this->steal(thread, tile)) {
+						break;
+					}
+					workerStats.tilesStolen++;
+				}
+
+				auto tileStart = std::chrono::high_resolution_clock::now();
+				renderTile(this->tiles[tile]);
+				std::chrono::duration<double> tileTime = std::chrono::high_resolution_clock::now() - tileStart;
+
+				workerStats.busySeconds += tileTime.count();
+				workerStats.tilesRendered++;
+			}
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		this->wallSeconds = elapsed.count();
+	};
+
+	// busy time of each thread during the last run
+	std::vector<double> getBusySeconds() const {
+		std::vector<double> busySeconds;
+		for(auto const& workerStats : this->stats) {
+			busySeconds.push_back(workerStats.busySeconds);
+		}
+		return busySeconds;
+	};
+
+	void printStatistics(std::ostream &out = std::cout) const {
+		double totalBusy = 0;
+		for(int thread = 0; thread < this->threadCount; thread++) {
+			const WorkerStats &workerStats = this->stats[thread];
+			totalBusy += workerStats.busySeconds;
+			out << "thread " << thread << ": busy " << workerStats.busySeconds << " s, "
+				<< workerStats.tilesRendered << " tiles (" << workerStats.tilesStolen << " stolen)" << std::endl;
+		}
+		// 1.0 means every thread rendered for the whole frame
+		const double utilization = this->wallSeconds > 0 ? totalBusy / (this->wallSeconds * this->threadCount) : 0;
+		out << this->tiles.size() << " tiles on " << this->threadCount << " threads, utilization " << utilization << std::endl;
+	};
+};
+
+#endif /* SRC_SCHEDULER_H_ */
@@ -0,0 +1,386 @@
+/*
+ * simd.h
+ *
+ *  Vectorized ray intersection kernels testing a batch of SIMD_WIDTH triangles (Moeller-Trumbore
+ *  with precomputed edges) or spheres against one ray. Batches store their primitives in SoA layout.
+ *  AVX builds use 8 lanes, SSE2 builds 4 lanes, everything else a scalar loop over 4 lanes.
+ */
+
+#ifndef SRC_SIMD_H_
+#define SRC_SIMD_H_
+
+#include "geometries.h"
+#include "statistics.h"
+
+#include <vector>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 4
+#define SIMD_SCALAR
+#endif
+
+// packed floats with the few operations the kernels need
+struct vfloat {
+#if defined(__AVX__)
+	__m256 v;
+	vfloat() { }
+	vfloat(__m256 v) : v(v) { }
+	explicit vfloat(float s) : v(_mm256_set1_ps(s)) { }
+	static vfloat load(const float *p) { return _mm256_load_ps(p); }
+	void store(float *p) const { _mm256_store_ps(p, v); }
+	friend vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+	friend vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+	friend vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+	friend vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+	friend vfloat operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	friend vfloat operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	friend vfloat operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+	friend vfloat operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+	friend vfloat operator!=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ); }
+	friend vfloat operator&(vfloat a, vfloat b) { return _mm256_and_ps(a.v, b.v); }
+	friend vfloat sqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+	friend vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+	friend vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+	// picks a where mask is set, b otherwise
+	friend vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+	friend int movemask(vfloat mask) { return _mm256_movemask_ps(mask.v); }
+#elif !defined(SIMD_SCALAR)
+	__m128 v;
+	vfloat() { }
+	vfloat(__m128 v) : v(v) { }
+	explicit vfloat(float s) : v(_mm_set1_ps(s)) { }
+	static vfloat load(const float *p) { return _mm_load_ps(p); }
+	void store(float *p) const { _mm_store_ps(p, v); }
+	friend vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+	friend vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+	friend vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+	friend vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+	friend vfloat operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+	friend vfloat operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+	friend vfloat operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+	friend vfloat operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+	friend vfloat operator!=(vfloat a, vfloat b) { return _mm_cmpneq_ps(a.v, b.v); }
+	friend vfloat operator&(vfloat a, vfloat b) { return _mm_and_ps(a.v, b.v); }
+	friend vfloat sqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+	friend vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+	friend vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+	friend vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+	friend int movemask(vfloat mask) { return _mm_movemask_ps(mask.v); }
+#else
+	// scalar fallback, masks are stored as 0 / 1 per lane
+	float v[SIMD_WIDTH];
+	vfloat() { }
+	explicit vfloat(float s) { for(int i = 0; i < SIMD_WIDTH; i++) v[i] = s; }
+	static vfloat load(const float *p) { vfloat r; for(int i = 0; i < SIMD_WIDTH; i++) r.v[i] = p[i]; return r; }
+	void store(float *p) const { for(int i = 0; i < SIMD_WIDTH; i++) p[i] = v[i]; }
+	template<typename F> static vfloat map(vfloat a, vfloat b, F f) { vfloat r; for(int i = 0; i < SIMD_WIDTH; i++) r.v[i] = f(a.v[i], b.v[i]); return r; }
+	friend vfloat operator+(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return x + y; }); }
+	friend vfloat operator-(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return x - y; }); }
+	friend vfloat operator*(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return x * y; }); }
+	friend vfloat operator/(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return x / y; }); }
+	friend vfloat operator<(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x < y); }); }
+	friend vfloat operator>(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x > y); }); }
+	friend vfloat operator<=(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x <= y); }); }
+	friend vfloat operator>=(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x >= y); }); }
+	friend vfloat operator!=(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x != y); }); }
+	friend vfloat operator&(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return float(x != 0 && y != 0); }); }
+	friend vfloat sqrt(vfloat a) { vfloat r; for(int i = 0; i < SIMD_WIDTH; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+	friend vfloat min(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return y < x ? y : x; }); }
+	friend vfloat max(vfloat a, vfloat b) { return map(a, b, [](float x, float y) { return x < y ? y : x; }); }
+	friend vfloat select(vfloat mask, vfloat a, vfloat b) { vfloat r; for(int i = 0; i < SIMD_WIDTH; i++) r.v[i] = mask.v[i] != 0 ? a.v[i] : b.v[i]; return r; }
+	friend int movemask(vfloat mask) { int m = 0; for(int i = 0; i < SIMD_WIDTH; i++) m |= (mask.v[i] != 0) << i; return m; }
+#endif
+};
+
+// returns lane with the smallest t among the lanes set in mask, -1 if mask is empty
+inline int closestLane(int mask, const float *t, float &t_hit) {
+	int lane = -1;
+	while(mask) {
+		int i = __builtin_ctz(mask);
+		mask &= mask - 1;
+		if(lane < 0 || t[i] < t_hit) {
+			lane = i;
+			t_hit = t[i];
+		}
+	}
+	return lane;
+}
+
+// returns lowest lane set in mask, -1 if mask is empty
+inline int firstLane(int mask) {
+	return mask ? __builtin_ctz(mask) : -1;
+}
+
+// up to SIMD_WIDTH world space triangles, vertex A and edges B - A, C - A
+struct alignas(32) TriangleBatch {
+	float v0x[SIMD_WIDTH], v0y[SIMD_WIDTH], v0z[SIMD_WIDTH];
+	float e1x[SIMD_WIDTH], e1y[SIMD_WIDTH], e1z[SIMD_WIDTH];
+	float e2x[SIMD_WIDTH], e2y[SIMD_WIDTH], e2z[SIMD_WIDTH];
+	PrimitiveRef primitives[SIMD_WIDTH];
+	int count = 0;
+
+	void add(PrimitiveRef primitive, glm::vec3 A, glm::vec3 B, glm::vec3 C) {
+		int i = this->count++;
+		glm::vec3 e1 = B - A, e2 = C - A;
+		v0x[i] = A.x; v0y[i] = A.y; v0z[i] = A.z;
+		e1x[i] = e1.x; e1y[i] = e1.y; e1z[i] = e1.z;
+		e2x[i] = e2.x; e2y[i] = e2.y; e2z[i] = e2.z;
+		primitives[i] = primitive;
+	}
+
+	// zero unused lanes so the kernel doesn't compute on garbage
+	void pad() {
+		for(int i = this->count; i < SIMD_WIDTH; i++) {
+			v0x[i] = v0y[i] = v0z[i] = e1x[i] = e1y[i] = e1z[i] = e2x[i] = e2y[i] = e2z[i] = 0;
+			primitives[i] = {nullptr, 0};
+		}
+	}
+
+	// mask of the lanes hit with 0 < t < t_max, their t is written to t_lanes
+	inline int hitMask(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max, float *t_lanes) const {
+		// same tolerance as intersectTriangle
+		const vfloat edgeEpsilon(1e-6f);
+		const vfloat zero(0.f), one(1.f);
+		const vfloat dx(rayDir.x), dy(rayDir.y), dz(rayDir.z);
+
+		const vfloat ax = vfloat::load(e1x), ay = vfloat::load(e1y), az = vfloat::load(e1z);
+		const vfloat bx = vfloat::load(e2x), by = vfloat::load(e2y), bz = vfloat::load(e2z);
+
+		// p = rayDir x e2
+		const vfloat px = dy * bz - dz * by, py = dz * bx - dx * bz, pz = dx * by - dy * bx;
+		const vfloat det = ax * px + ay * py + az * pz;
+		const vfloat invDet = one / det;
+
+		const vfloat sx = vfloat(rayOrigin.x) - vfloat::load(v0x);
+		const vfloat sy = vfloat(rayOrigin.y) - vfloat::load(v0y);
+		const vfloat sz = vfloat(rayOrigin.z) - vfloat::load(v0z);
+		const vfloat u = (sx * px + sy * py + sz * pz) * invDet;
+
+		// q = s x e1
+		const vfloat qx = sy * az - sz * ay, qy = sz * ax - sx * az, qz = sx * ay - sy * ax;
+		const vfloat v = (dx * qx + dy * qy + dz * qz) * invDet;
+		const vfloat t = (bx * qx + by * qy + bz * qz) * invDet;
+
+		const vfloat hit = (det != zero) & (u >= zero - edgeEpsilon) & (v >= zero - edgeEpsilon)
+				& (u + v <= one + edgeEpsilon) & (t > zero) & (t < vfloat(t_max));
+
+		t.store(t_lanes);
+		return movemask(hit) & ((1 << this->count) - 1);
+	}
+
+	// closest hit with 0 < t < t_max, returns hit lane or -1
+	inline int intersect(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max, float &t_hit) const {
+		alignas(32) float t_lanes[SIMD_WIDTH];
+		return closestLane(this->hitMask(rayOrigin, rayDir, t_max, t_lanes), t_lanes, t_hit);
+	}
+
+	// any hit with 0 < t < t_max, returns hit lane or -1
+	inline int occluded(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max) const {
+		alignas(32) float t_lanes[SIMD_WIDTH];
+		return firstLane(this->hitMask(rayOrigin, rayDir, t_max, t_lanes));
+	}
+
+	glm::vec3 getNormal(int lane) const {
+		return glm::cross(glm::vec3(e1x[lane], e1y[lane], e1z[lane]), glm::vec3(e2x[lane], e2y[lane], e2z[lane]));
+	}
+};
+
+// up to SIMD_WIDTH world space spheres
+struct alignas(32) SphereBatch {
+	float cx[SIMD_WIDTH], cy[SIMD_WIDTH], cz[SIMD_WIDTH];
+	float r2[SIMD_WIDTH];		// squared radius
+	PrimitiveRef primitives[SIMD_WIDTH];
+	int count = 0;
+
+	void add(PrimitiveRef primitive, glm::vec3 center, float radius) {
+		int i = this->count++;
+		cx[i] = center.x; cy[i] = center.y; cz[i] = center.z;
+		r2[i] = radius * radius;
+		primitives[i] = primitive;
+	}
+
+	void pad() {
+		for(int i = this->count; i < SIMD_WIDTH; i++) {
+			cx[i] = cy[i] = cz[i] = r2[i] = 0;
+			primitives[i] = {nullptr, 0};
+		}
+	}
+
+	// mask of the lanes hit with 0 < t < t_max, their t is written to t_lanes. Same roots as Sphere::intersect
+	inline int hitMask(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max, float *t_lanes) const {
+		const vfloat zero(0.f);
+		const vfloat dx(rayDir.x), dy(rayDir.y), dz(rayDir.z);
+		const vfloat invDD(1.f / glm::dot(rayDir, rayDir));
+
+		const vfloat qx = vfloat(rayOrigin.x) - vfloat::load(cx);
+		const vfloat qy = vfloat(rayOrigin.y) - vfloat::load(cy);
+		const vfloat qz = vfloat(rayOrigin.z) - vfloat::load(cz);
+
+		// t^2 + 2bt + c = 0
+		const vfloat b = (qx * dx + qy * dy + qz * dz) * invDD;
+		const vfloat c = (qx * qx + qy * qy + qz * qz - vfloat::load(r2)) * invDD;
+		const vfloat discriminant = b * b - c;
+		const vfloat root = sqrt(select(discriminant >= zero, discriminant, zero));
+
+		const vfloat t_near = zero - b - root;
+		const vfloat t_far = zero - b + root;
+		const vfloat t = select(t_near > zero, t_near, t_far);
+
+		const vfloat hit = (discriminant >= zero) & (t > zero) & (t < vfloat(t_max));
+
+		t.store(t_lanes);
+		return movemask(hit) & ((1 << this->count) - 1);
+	}
+
+	// closest hit with 0 < t < t_max, returns hit lane or -1
+	inline int intersect(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max, float &t_hit) const {
+		alignas(32) float t_lanes[SIMD_WIDTH];
+		return closestLane(this->hitMask(rayOrigin, rayDir, t_max, t_lanes), t_lanes, t_hit);
+	}
+
+	// any hit with 0 < t < t_max, returns hit lane or -1
+	inline int occluded(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_max) const {
+		alignas(32) float t_lanes[SIMD_WIDTH];
+		return firstLane(this->hitMask(rayOrigin, rayDir, t_max, t_lanes));
+	}
+
+	glm::vec3 getNormal(int lane, glm::vec3 position) const {
+		return position - glm::vec3(cx[lane], cy[lane], cz[lane]);
+	}
+};
+
+// SoA storage of a primitive list: transform free triangles and spheres in batches for the kernels,
+// all other primitives get tested one by one
+class PrimitiveBatches {
+	std::vector<TriangleBatch> triangleBatches;
+	std::vector<SphereBatch> sphereBatches;
+	std::vector<PrimitiveRef> scalarPrimitives;
+
+public:
+	void build(const std::vector<PrimitiveRef> &primitives) {
+		this->triangleBatches.clear();
+		this->sphereBatches.clear();
+		this->scalarPrimitives.clear();
+
+		for(auto const& primitive : primitives) {
+			glm::vec3 A, B, C;
+			float radius;
+			if(primitive.geometry_ptr->getWorldTriangle(primitive.primID, A, B, C)) {
+				if(this->triangleBatches.empty() || this->triangleBatches.back().count == SIMD_WIDTH) {
+					this->triangleBatches.emplace_back();
+				}
+				this->triangleBatches.back().add(primitive, A, B, C);
+			}
+			else if(primitive.geometry_ptr->getWorldSphere(primitive.primID, A, radius)) {
+				if(this->sphereBatches.empty() || this->sphereBatches.back().count == SIMD_WIDTH) {
+					this->sphereBatches.emplace_back();
+				}
+				this->sphereBatches.back().add(primitive, A, radius);
+			}
+			else {
+				this->scalarPrimitives.push_back(primitive);
+			}
+		}
+
+		if(!this->triangleBatches.empty()) {
+			this->triangleBatches.back().pad();
+		}
+		if(!this->sphereBatches.empty()) {
+			this->sphereBatches.back().pad();
+		}
+	}
+
+	void clear() {
+		std::vector<TriangleBatch>().swap(this->triangleBatches);
+		std::vector<SphereBatch>().swap(this->sphereBatches);
+		std::vector<PrimitiveRef>().swap(this->scalarPrimitives);
+	}
+
+	// updates the closest hit found so far. Batched primitives are cheap enough to retest,
+	// only the scalar ones go through the mailbox
+	inline void intersectClosest(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit,
+			HitInfo &min_hitInfo, ITransformedIntersectable *&min_geometry_ptr, Mailbox *mailbox = nullptr) const {
+		for(auto const& batch : this->triangleBatches) {
+			float t_hit;
+			int lane = batch.intersect(rayOrigin, rayDir, std::min(t_limit, min_hitInfo.t), t_hit);
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, batch.count);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_geometry_ptr = batch.primitives[lane].geometry_ptr;
+				min_hitInfo = HitInfo(true, t_hit, batch.getNormal(lane), min_geometry_ptr->materialIndex);
+			}
+		}
+
+		for(auto const& batch : this->sphereBatches) {
+			float t_hit;
+			int lane = batch.intersect(rayOrigin, rayDir, std::min(t_limit, min_hitInfo.t), t_hit);
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, batch.count);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_geometry_ptr = batch.primitives[lane].geometry_ptr;
+				min_hitInfo = HitInfo(true, t_hit, batch.getNormal(lane, rayOrigin + t_hit * rayDir), min_geometry_ptr->materialIndex);
+			}
+		}
+
+		for(auto const& primitive : this->scalarPrimitives)  {
+			if(mailbox && mailbox->testAndSet(primitive)) {
+				continue;
+			}
+
+			HitInfo hitInfo = primitive.intersectWorld(rayOrigin, rayDir);
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, 1);
+
+			if(hitInfo.validHit && hitInfo.t < min_hitInfo.t && hitInfo.t < t_limit) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				min_hitInfo = hitInfo;
+				min_geometry_ptr = primitive.geometry_ptr;
+			}
+		}
+	}
+
+	// true on the first primitive blocking the ray within (0, t_limit), which is stored in occluder
+	inline bool intersectAny(glm::vec3 rayOrigin, glm::vec3 rayDir, float t_limit,
+			PrimitiveRef *occluder = nullptr, Mailbox *mailbox = nullptr) const {
+		for(auto const& batch : this->triangleBatches) {
+			int lane = batch.occluded(rayOrigin, rayDir, t_limit);
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, batch.count);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				if(occluder) *occluder = batch.primitives[lane];
+				return true;
+			}
+		}
+
+		for(auto const& batch : this->sphereBatches) {
+			int lane = batch.occluded(rayOrigin, rayDir, t_limit);
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, batch.count);
+			if(lane >= 0) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				if(occluder) *occluder = batch.primitives[lane];
+				return true;
+			}
+		}
+
+		for(auto const& primitive : this->scalarPrimitives)  {
+			if(mailbox && mailbox->testAndSet(primitive)) {
+				continue;
+			}
+			COUNT_STATISTIC(STAT_PRIMITIVES_TESTED, 1);
+			if(primitive.occludedWorld(rayOrigin, rayDir, t_limit)) {
+				COUNT_STATISTIC(STAT_PRIMITIVE_HITS, 1);
+				if(occluder) *occluder = primitive;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+#endif /* SRC_SIMD_H_ */
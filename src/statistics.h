@@ -0,0 +1,123 @@
+/*
+ * statistics.h
+ *
+ *  Per pixel ray and traversal counters, written out as false color heatmaps.
+ *  Only compiled in with RAYTRACER_STATISTICS=1 (cmake -DENABLE_STATISTICS=ON), otherwise
+ *  COUNT_STATISTIC expands to nothing and the renderer has no statistics code at all.
+ */
+
+#ifndef SRC_STATISTICS_H_
+#define SRC_STATISTICS_H_
+
+#ifndef RAYTRACER_STATISTICS
+#define RAYTRACER_STATISTICS 0
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Image3f.h"
+
+enum StatisticsCounter {
+	STAT_PRIMARY_RAYS,
+	STAT_REFLECTION_RAYS,
+	STAT_SHADOW_RAYS,
+	STAT_CELLS_VISITED,		// grid cells stepped through, nested grids included
+	STAT_NODES_VISITED,		// BVH nodes popped from the traversal stack
+	STAT_PRIMITIVES_TESTED,	// ray primitive tests, every batch lane counts
+	STAT_PRIMITIVE_HITS,	// primitive tests that hit, closer hits replace earlier ones
+	STAT_COUNTER_COUNT
+};
+
+inline const char *statisticsCounterNames[STAT_COUNTER_COUNT] = {
+	"primary_rays", "reflection_rays", "shadow_rays", "cells_visited", "nodes_visited", "primitives_tested", "primitive_hits"
+};
+
+struct RayStatistics {
+	std::uint32_t counts[STAT_COUNTER_COUNT] = {};
+};
+
+// counts of the pixel the thread is working on
+inline thread_local RayStatistics pixelStatistics;
+
+#if RAYTRACER_STATISTICS
+#define COUNT_STATISTIC(counter, n) (pixelStatistics.counts[counter] += std::uint32_t(n))
+#else
+#define COUNT_STATISTIC(counter, n) ((void) 0)
+#endif
+
+// counts of every pixel of a frame
+class FrameStatistics {
+	int width, height;
+	std::vector<RayStatistics> pixels;
+
+	// blue over green to red, like the jet colormap
+	static glm::vec3 falseColor(float value) {
+		value = glm::clamp(value, 0.f, 1.f);
+		return glm::vec3(glm::clamp(1.5f - glm::abs(4.f * value - 3.f), 0.f, 1.f),
+						 glm::clamp(1.5f - glm::abs(4.f * value - 2.f), 0.f, 1.f),
+						 glm::clamp(1.5f - glm::abs(4.f * value - 1.f), 0.f, 1.f));
+	}
+
+public:
+	FrameStatistics(int width, int height) : width(width), height(height), pixels(size_t(width) * height) { };
+
+	inline void beginPixel() {
+		pixelStatistics = RayStatistics();
+	};
+
+	// continues counting on top of the counts of pixel x, y, for samples traced later
+	inline void resumePixel(int x, int y) {
+		pixelStatistics = this->pixels[size_t(y) * this->width + x];
+	};
+
+	inline void endPixel(int x, int y) {
+		this->pixels[size_t(y) * this->width + x] = pixelStatistics;
+	};
+
+	std::uint64_t total(StatisticsCounter counter) const {
+		std::uint64_t sum = 0;
+		for(auto const& pixel : this->pixels) {
+			sum += pixel.counts[counter];
+		}
+		return sum;
+	};
+
+	void printTotals(std::ostream &out = std::cout) const {
+		const std::uint64_t primaryRays = std::max<std::uint64_t>(this->total(STAT_PRIMARY_RAYS), 1);
+		for(int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+			std::uint64_t sum = this->total(StatisticsCounter(counter));
+			out << statisticsCounterNames[counter] << ": " << sum
+				<< " (" << double(sum) / double(primaryRays) << " per primary ray)" << std::endl;
+		}
+	};
+
+	// one image per counter, basename_counter.png. Colors are scaled to the largest count of the frame
+	void writeHeatmaps(const std::string &basename) const {
+		for(int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+			std::uint32_t maximum = 0;
+			for(auto const& pixel : this->pixels) {
+				maximum = std::max(maximum, pixel.counts[counter]);
+			}
+			if(maximum == 0) {
+				continue;
+			}
+
+			Image3f heatmap(this->width, this->height);
+			for(int y = 0; y < this->height; y++) {
+				for(int x = 0; x < this->width; x++) {
+					float value = float(this->pixels[size_t(y) * this->width + x].counts[counter]) / float(maximum);
+					heatmap.setAt(x, y, falseColor(value));
+				}
+			}
+			heatmap.save(basename + "_" + statisticsCounterNames[counter] + ".png");
+		}
+	};
+};
+
+#endif /* SRC_STATISTICS_H_ */
@@ -0,0 +1,228 @@
+/*
+ * wavefront.h
+ *
+ *  Renders a tile stage by stage instead of path by path: all rays of a bounce get intersected, their
+ *  hits shaded and the shadow and reflection rays of the next stage queued, until no path continues.
+ */
+
+#ifndef SRC_WAVEFRONT_H_
+#define SRC_WAVEFRONT_H_
+
+#include <omp.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "readScene.h"
+#include "scheduler.h"
+#include "lighting.h"
+#include "Image3f.h"
+
+// Queues of one render thread, reused from tile to tile. The image is the same as the one of shade().
+// Hits get shaded grouped by material and octant of their ray, shadow rays get traced light by light and
+// reflection rays grouped by octant, so rays traced one after another mostly take the same way through
+// the acceleration structure and hits shaded one after another read the same material.
+class Wavefront {
+	// a ray of the current stage, direction unnormalized as shade() gets it
+	struct Ray {
+		int path;
+		glm::vec3 origin;
+		glm::vec3 direction;
+	};
+
+	struct Hit {
+		int path;
+		glm::vec3 rayDir;
+		FragmentInfo fragmentInfo;
+	};
+
+	// a light that matters for a hit, queued hit by hit and traced light by light
+	struct ShadowQuery {
+		int light;
+		ShadowRay ray;
+	};
+
+	// per path (pixel of the tile)
+	std::vector<int> hitCounts;
+	std::vector<glm::vec3> throughputs;
+	std::vector<glm::vec3> localColors;		// maxDepth + 1 per path, combined back to front like in shade()
+	std::vector<glm::vec3> specularColors;
+
+	std::vector<Ray> rays, sortedRays;
+	std::vector<Hit> hits, sortedHits;
+	std::vector<ShadowQuery> shadowQueries;	// hit major, the ones of hit are [shadowOffsets[hit], shadowOffsets[hit + 1])
+	std::vector<int> shadowOffsets;
+	std::vector<int> queryOrder, sortedQueryOrder;	// shadow queries sorted by light
+	std::vector<char> visible;				// per shadow query
+	std::vector<int> binOffsets;
+
+	static int octant(glm::vec3 direction) {
+		return (direction.x < 0) | (direction.y < 0) << 1 | (direction.z < 0) << 2;
+	}
+
+	// stable counting sort of items into sorted by key(item) in [0, keyCount)
+	template<typename Item, typename Key>
+	void sortByKey(const std::vector<Item> &items, std::vector<Item> &sorted, int keyCount, Key key) {
+		this->binOffsets.assign(keyCount + 1, 0);
+		for(auto const& item : items) {
+			this->binOffsets[key(item) + 1]++;
+		}
+		for(int bin = 0; bin < keyCount; bin++) {
+			this->binOffsets[bin + 1] += this->binOffsets[bin];
+		}
+		sorted.resize(items.size());
+		for(auto const& item : items) {
+			sorted[this->binOffsets[key(item)]++] = item;
+		}
+	}
+
+	// intersects the primary rays of the tile, in packets if packetSize > 0
+	void tracePrimaryRays(const Tile &tile, SceneReader &sr, BVH *bvh, int packetSize) {
+		const int tileWidth = tile.x1 - tile.x0;
+		if(packetSize > 0) {
+			RayPacket packet;
+			FragmentInfo fragmentInfos[RayPacket::maxSize];
+			for(int y = tile.y0; y < tile.y1; y += packetSize) {
+				for(int x = tile.x0; x < tile.x1; x += packetSize) {
+					sr.camera.getRayPacket(x, y, packetSize, packet);
+					bvh->intersectPacket(packet, fragmentInfos);
+					for(int lane = 0; lane < packet.size; lane++) {
+						if(fragmentInfos[lane].validHit) {
+							const int path = (packet.py[lane] - tile.y0) * tileWidth + packet.px[lane] - tile.x0;
+							this->hits.push_back({path, packet.getDirection(lane), fragmentInfos[lane]});
+						}
+					}
+				}
+			}
+			return;
+		}
+
+		for(int y = tile.y0; y < tile.y1; y++) {
+			for(int x = tile.x0; x < tile.x1; x++) {
+				const glm::vec3 rayDir = sr.camera.getRayAt(x, y);
+				FragmentInfo fragmentInfo = sr.scene_content->intersect(sr.camera.eye, glm::normalize(rayDir));
+				if(fragmentInfo.validHit) {
+					this->hits.push_back({(y - tile.y0) * tileWidth + x - tile.x0, rayDir, fragmentInfo});
+				}
+			}
+		}
+	}
+
+	// local colors of all hits and the reflection rays of the paths that continue
+	void shadeHits(SceneReader &sr) {
+		const int lightCount = int(sr.lights.size());
+		const int materialCount = std::max(int(sr.materials.size()), 1);
+		this->sortByKey(this->hits, this->sortedHits, materialCount * 8, [&](const Hit &hit) {
+			return hit.fragmentInfo.materialIndex * 8 + octant(hit.rayDir);
+		});
+		const int hitCount = int(this->sortedHits.size());
+
+		// the lights that matter for every hit like in shadowRayTest(), in light order
+		this->shadowQueries.clear();
+		this->shadowOffsets.resize(hitCount + 1);
+		for(int hit = 0; hit < hitCount; hit++) {
+			this->shadowOffsets[hit] = int(this->shadowQueries.size());
+			const Hit &current = this->sortedHits[hit];
+			const Material &material = sr.materials[current.fragmentInfo.materialIndex];
+			sr.lightCuller.forRelevantLights(current.fragmentInfo.position, [&](int light) {
+				const ShadowRay shadowRay = shadowRayTowards(sr.lights[light], current.fragmentInfo.position, sr.epsilonBias);
+				if(sr.lightCuller.matters(contributionBound(sr.lights[light], shadowRay, current.fragmentInfo.normal, &material))) {
+					this->shadowQueries.push_back({light, shadowRay});
+				}
+			});
+		}
+		this->shadowOffsets[hitCount] = int(this->shadowQueries.size());
+
+		// shadow rays light by light, all of them towards the same light are traced one after another
+		this->queryOrder.resize(this->shadowQueries.size());
+		for(size_t query = 0; query < this->queryOrder.size(); query++) {
+			this->queryOrder[query] = int(query);
+		}
+		this->sortByKey(this->queryOrder, this->sortedQueryOrder, std::max(lightCount, 1), [&](int query) {
+			return this->shadowQueries[query].light;
+		});
+		this->visible.resize(this->shadowQueries.size());
+		OccluderCache &occluderCache = sr.occluderCaches[omp_get_thread_num()];
+		for(int query : this->sortedQueryOrder) {
+			const ShadowQuery &shadowQuery = this->shadowQueries[query];
+			this->visible[query] = !occluderCache.occluded(sr.scene_content.get(), shadowQuery.light,
+					shadowQuery.ray.origin, shadowQuery.ray.direction, shadowQuery.ray.t_max);
+		}
+
+		this->rays.clear();
+		for(int hit = 0; hit < hitCount; hit++) {
+			const Hit &current = this->sortedHits[hit];
+			const FragmentInfo &fragmentInfo = current.fragmentInfo;
+			const Material &material = sr.materials[fragmentInfo.materialIndex];
+
+			// summed in light order like in shadowRayTest()
+			glm::vec3 shadowColor(0, 0, 0);
+			for(int query = this->shadowOffsets[hit]; query < this->shadowOffsets[hit + 1]; query++) {
+				const ShadowQuery &shadowQuery = this->shadowQueries[query];
+				if(this->visible[query]) {
+					shadowColor += lightContribution(sr.lights[shadowQuery.light], shadowQuery.ray, current.rayDir, fragmentInfo.normal, &material);
+				}
+			}
+
+			const int path = current.path;
+			const size_t slot = size_t(path) * (sr.maxDepth + 1) + this->hitCounts[path];
+			this->localColors[slot] = material.ambientColor + material.emissionColor + clampRGB(shadowColor);
+			this->specularColors[slot] = material.specularColor;
+			this->hitCounts[path]++;
+
+			glm::vec3 &throughput = this->throughputs[path];
+			throughput *= material.specularColor;
+			if(this->hitCounts[path] > sr.maxDepth || glm::max(throughput[0], glm::max(throughput[1], throughput[2])) <= sr.minThroughput) {
+				continue;
+			}
+
+			glm::vec3 viewDir = glm::normalize(-current.rayDir);
+			glm::vec3 reflectedDir = (2 * glm::dot(viewDir, fragmentInfo.normal) * fragmentInfo.normal) - viewDir;
+			this->rays.push_back({path, fragmentInfo.position + sr.epsilonBias * reflectedDir, reflectedDir});
+		}
+	}
+
+	// intersects the reflection rays grouped by octant, their hits are the next stage
+	void traceReflectionRays(SceneReader &sr) {
+		this->sortByKey(this->rays, this->sortedRays, 8, [](const Ray &ray) {
+			return octant(ray.direction);
+		});
+
+		this->hits.clear();
+		for(auto const& ray : this->sortedRays) {
+			FragmentInfo fragmentInfo = sr.scene_content->intersect(ray.origin, glm::normalize(ray.direction));
+			if(fragmentInfo.validHit) {
+				this->hits.push_back({ray.path, ray.direction, fragmentInfo});
+			}
+		}
+	}
+
+public:
+	// renders tile into image, bvh and packetSize as for renderTile()
+	void render(const Tile &tile, SceneReader &sr, Image3f &image, BVH *bvh, int packetSize) {
+		const int tileWidth = tile.x1 - tile.x0;
+		const int pathCount = tileWidth * (tile.y1 - tile.y0);
+		this->hitCounts.assign(pathCount, 0);
+		this->throughputs.assign(pathCount, glm::vec3(1, 1, 1));
+		this->localColors.resize(size_t(pathCount) * (sr.maxDepth + 1));
+		this->specularColors.resize(this->localColors.size());
+
+		this->hits.clear();
+		this->tracePrimaryRays(tile, sr, bvh, packetSize);
+		while(!this->hits.empty()) {
+			this->shadeHits(sr);
+			this->traceReflectionRays(sr);
+		}
+
+		for(int path = 0; path < pathCount; path++) {
+			glm::vec3 color(0, 0, 0);
+			for(int hit = this->hitCounts[path] - 1; hit >= 0; hit--) {
+				const size_t slot = size_t(path) * (sr.maxDepth + 1) + hit;
+				color = clampRGB(this->localColors[slot] + this->specularColors[slot] * color);
+			}
+			image.setAt(tile.x0 + path % tileWidth, tile.y0 + path / tileWidth, color);
+		}
+	}
+};
+
+#endif /* SRC_WAVEFRONT_H_ */
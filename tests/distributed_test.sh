@@ -0,0 +1,77 @@
+#!/bin/bash
+# Renders scene locally and on workers over localhost, the images have to be byte identical.
+#   distributed_test.sh raytracing-binary spawn|kill scene.test
+# spawn: the coordinator starts 3 local workers.
+# kill:  the first worker is stopped while it holds tiles and then killed with SIGKILL,
+#        two workers started afterwards have to render its re-issued tiles.
+binary=$1
+mode=$2
+scene=$3
+options="--no-cache -r 320x240 -t 1"
+
+work=$(mktemp -d)
+pids=()
+cleanup() {
+	for pid in "${pids[@]}"; do
+		kill -9 "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+	done
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*"
+	for log in "$work"/*.log; do
+		echo "--- $log"
+		tail -20 "$log"
+	done
+	exit 1
+}
+
+# waits up to 30 seconds for a line matching pattern in file
+wait_for() {
+	for i in $(seq 300); do
+		grep -q "$2" "$1" 2>/dev/null && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+"$binary" $options -o "$work/local.ppm" "$scene" > "$work/local.log" 2>&1 || fail "local render"
+
+if [ "$mode" = spawn ]; then
+	timeout 120 "$binary" $options --coordinator 0 --spawn-workers 3 -o "$work/distributed.ppm" "$scene" \
+		> "$work/coordinator.log" 2>&1 || fail "distributed render"
+elif [ "$mode" = kill ]; then
+	"$binary" $options --coordinator 0 -o "$work/distributed.ppm" "$scene" > "$work/coordinator.log" 2>&1 &
+	coordinator=$!
+	pids+=($coordinator)
+	wait_for "$work/coordinator.log" "waiting for workers on port" || fail "coordinator didn't start"
+	port=$(sed -n 's/.*waiting for workers on port \([0-9]*\).*/\1/p' "$work/coordinator.log" | head -1)
+
+	"$binary" -t 1 --worker "localhost:$port" > "$work/killed.log" 2>&1 &
+	killed=$!
+	pids+=($killed)
+	wait_for "$work/coordinator.log" "worker 0 connected" || fail "first worker didn't connect"
+	kill -STOP "$killed"
+	sleep 0.5
+	kill -9 "$killed"
+	wait "$killed" 2>/dev/null
+
+	for worker in 1 2; do
+		"$binary" -t 1 --worker "localhost:$port" > "$work/worker$worker.log" 2>&1 &
+		pids+=($!)
+	done
+	for i in $(seq 1200); do
+		kill -0 "$coordinator" 2>/dev/null || break
+		sleep 0.1
+	done
+	kill -0 "$coordinator" 2>/dev/null && fail "coordinator didn't finish"
+	wait "$coordinator" || fail "distributed render"
+	grep -q "lost a worker, reissuing [1-9]" "$work/coordinator.log" || fail "the killed worker held no tiles"
+else
+	fail "unknown mode $mode"
+fi
+
+cmp "$work/local.ppm" "$work/distributed.ppm" || fail "distributed render differs from the local one"
+echo "PASS"
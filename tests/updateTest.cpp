@@ -0,0 +1,170 @@
+/*
+ * updateTest.cpp
+ *
+ *  Edits the geometries of a scene (move, add, remove) and checks that the acceleration structure
+ *  updated in place answers like one built fresh over the edited geometries: closest hits, shadow
+ *  rays and an image shaded through the occluder caches, for the BVH and the grid.
+ *
+ *  updateTest scene.test ...
+ */
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "readScene.h"
+#include "lighting.h"
+
+namespace {
+
+const int pixelStep = 2;	// every second pixel per axis is traced
+
+// primary hits lit by all lights like shadowRayTest(), the shadow rays go through occluderCache
+std::vector<glm::vec3> render(SceneReader &sr, IIntersectable *scene, OccluderCache &occluderCache) {
+	std::vector<glm::vec3> image;
+	for(int y = 0; y < sr.camera.height; y += pixelStep) {
+		for(int x = 0; x < sr.camera.width; x += pixelStep) {
+			const glm::vec3 rayDir = sr.camera.getRayAt(x, y);
+			FragmentInfo fragmentInfo = scene->intersect(sr.camera.eye, glm::normalize(rayDir));
+			if(!fragmentInfo.validHit) {
+				image.push_back(glm::vec3(0, 0, 0));
+				continue;
+			}
+			const Material &material = sr.materials[fragmentInfo.materialIndex];
+			glm::vec3 shadowColor(0, 0, 0);
+			for(int light = 0; light < int(sr.lights.size()); light++) {
+				const ShadowRay shadowRay = shadowRayTowards(sr.lights[light], fragmentInfo.position, sr.epsilonBias);
+				if(!occluderCache.occluded(scene, light, shadowRay.origin, shadowRay.direction, shadowRay.t_max)) {
+					shadowColor += lightContribution(sr.lights[light], shadowRay, rayDir, fragmentInfo.normal, &material);
+				}
+			}
+			image.push_back(material.ambientColor + material.emissionColor + clampRGB(shadowColor));
+		}
+	}
+	return image;
+}
+
+// number of camera rays whose closest hit or shadow ray differ between updated and fresh
+int compareRays(SceneReader &sr, IIntersectable *updated, IIntersectable *fresh) {
+	const glm::vec3 lightDir = glm::normalize(glm::vec3(1, 2, 3));
+	int mismatches = 0;
+	for(int y = 0; y < sr.camera.height; y += pixelStep) {
+		for(int x = 0; x < sr.camera.width; x += pixelStep) {
+			const glm::vec3 rayDir = glm::normalize(sr.camera.getRayAt(x, y));
+			FragmentInfo a = updated->intersect(sr.camera.eye, rayDir);
+			FragmentInfo b = fresh->intersect(sr.camera.eye, rayDir);
+			if(a.validHit != b.validHit || (a.validHit && std::abs(a.t - b.t) > 1e-4f * b.t)) {
+				mismatches++;
+				continue;
+			}
+			if(a.validHit) {
+				const glm::vec3 origin = a.position + sr.epsilonBias * lightDir;
+				mismatches += updated->occluded(origin, lightDir) != fresh->occluded(origin, lightDir);
+			}
+		}
+	}
+	return mismatches;
+}
+
+int compareImages(const std::vector<glm::vec3> &a, const std::vector<glm::vec3> &b) {
+	int mismatches = 0;
+	for(size_t pixel = 0; pixel < a.size(); pixel++) {
+		const glm::vec3 difference = glm::abs(a[pixel] - b[pixel]);
+		mismatches += glm::max(difference[0], glm::max(difference[1], difference[2])) > 1e-3f;
+	}
+	return mismatches;
+}
+
+// edits of round: small and large moves, a rotation, added spheres and triangles and removed geometries
+void edit(SceneReader &sr, int round, std::mt19937 &random) {
+	std::uniform_real_distribution<float> uniform(-1, 1);
+	auto anyGeometry = [&]() {
+		return sr.geometries[random() % sr.geometries.size()];
+	};
+	auto offset = [&](float distance) {
+		return glm::vec3(uniform(random), uniform(random), uniform(random)) * distance;
+	};
+
+	const int edits = std::max(1, std::min(int(sr.geometries.size()) / 2, 3));
+	for(int i = 0; i < edits; i++) {
+		// small moves stay in the grid bounds, large ones leave them
+		sr.moveGeometry(anyGeometry(), glm::translate(offset(round % 2 == 0 ? 0.05f : 2.f)));
+	}
+	if(round == 2) {
+		sr.moveGeometry(anyGeometry(), glm::rotate(0.5f, glm::vec3(0, 1, 0)) * glm::scale(glm::vec3(1.2f, 0.8f, 1.f)));
+	}
+	if(round == 1 || round == 3) {
+		for(int i = 0; i < edits; i++) {
+			const glm::vec3 center = sr.camera.center + offset(2);
+			sr.addGeometry(new Sphere(center, 0.3f, 0, glm::mat4(1.f)));
+			sr.addGeometry(new Triangle(center, center + glm::vec3(0.5f, 0, 0), center + glm::vec3(0, 0.5f, 0), 0, glm::mat4(1.f)));
+		}
+	}
+	if(round == 2 || round == 5) {
+		for(int i = 0; i < edits && sr.geometries.size() > 1; i++) {
+			sr.removeGeometry(anyGeometry());
+		}
+	}
+}
+
+// runs the edit rounds on scenefilename with accelerationType, returns the number of failed checks
+int testScene(const std::string &scenefilename, AccelerationType accelerationType, const char *name) {
+	SceneReader sr;
+	sr.readScene(scenefilename, accelerationType);
+	if(!sr.scene_content || sr.materials.empty()) {
+		std::cout << "FAIL: could not read " << scenefilename << std::endl;
+		return 1;
+	}
+	sr.camera.updateAxes();
+	sr.occluderCaches.assign(1, OccluderCache(sr.lights.size()));
+
+	std::mt19937 random(1);
+	int failures = 0, rebuilds = 0;
+	for(int round = 0; round < 6; round++) {
+		// fills the occluder cache with geometries the edits may remove
+		render(sr, sr.scene_content.get(), sr.occluderCaches[0]);
+
+		edit(sr, round, random);
+		rebuilds += !sr.commitUpdates();
+
+		std::unique_ptr<IIntersectable> fresh;
+		if(accelerationType == AccelerationType::BVH) {
+			fresh = std::make_unique<BVH>(&sr.geometries);
+		}
+		else {
+			fresh = std::make_unique<Grid>(&sr.geometries);
+		}
+		OccluderCache freshCache(sr.lights.size());
+
+		const int rayMismatches = compareRays(sr, sr.scene_content.get(), fresh.get());
+		const int pixelMismatches = compareImages(render(sr, sr.scene_content.get(), sr.occluderCaches[0]),
+				render(sr, fresh.get(), freshCache));
+		if(rayMismatches > 0 || pixelMismatches > 0) {
+			std::cout << "FAIL: " << scenefilename << " " << name << " round " << round << ": " << rayMismatches
+					<< " rays and " << pixelMismatches << " pixels differ from a fresh build" << std::endl;
+			failures++;
+		}
+	}
+	std::cout << scenefilename << " " << name << ": " << sr.geometries.size() << " geometries, "
+			<< rebuilds << " of 6 commits rebuilt" << std::endl;
+	return failures;
+}
+
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2) {
+		std::cerr << "usage: updateTest scene.test ..." << std::endl;
+		return 2;
+	}
+	int failures = 0;
+	for(int i = 1; i < argc; i++) {
+		failures += testScene(argv[i], AccelerationType::BVH, "bvh");
+		failures += testScene(argv[i], AccelerationType::GRID, "grid");
+	}
+	std::cout << (failures == 0 ? "PASS" : "FAIL") << std::endl;
+	return failures == 0 ? 0 : 1;
+}